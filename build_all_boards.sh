@@ -10,11 +10,23 @@ version="$1"
 mkdir buildx
 mkdir buildx/images
 
+# Every board gets an image executing in place from flash,
+# and one that copies itself to SRAM and runs from there.
 for board in $(cat supported_boards.txt); do
-	printf "BUILDING IMAGE FOR BOARD '%s'\n" $board
-	bdir=buildx/$board
-	mkdir -p $bdir
-	cmake -B $bdir -DCMAKE_BUILD_TYPE=Release -DPICO_BOARD=$board
-	make -C $bdir $MAKEFLAGS
-	picotool uf2 convert $bdir/PicoFET.elf "buildx/images/PicoFET_${version}_${board}.uf2"
+	for variant in flash ram; do
+		printf "BUILDING %s IMAGE FOR BOARD '%s'\n" $variant $board
+		if [ $variant = ram ]; then
+			bdir=buildx/${board}_ram
+			suffix=_ram
+			copy_to_ram=ON
+		else
+			bdir=buildx/$board
+			suffix=
+			copy_to_ram=OFF
+		fi
+		mkdir -p $bdir
+		cmake -B $bdir -DCMAKE_BUILD_TYPE=Release -DPICO_BOARD=$board -DPICOFET_COPY_TO_RAM=$copy_to_ram
+		make -C $bdir $MAKEFLAGS
+		picotool uf2 convert $bdir/PicoFET.elf "buildx/images/PicoFET_${version}_${board}${suffix}.uf2"
+	done
 done
@@ -42,6 +42,9 @@ unsigned char fet_buffer[FET_BUFFER_CAPACITY];
 
 char command_line[MAX_COMMAND_LENGTH];
 
+// Time spent in the handler of the last command other than CMD:ELAPSED_US
+unsigned long cmd_elapsed_us;
+
 void send_status(struct comm *t, int status) {
 	char msg[64];
 	int length = snprintf(msg, sizeof msg, "%03d %s\r\n", status, pfet_get_status_message(status));
@@ -130,6 +133,45 @@ void cmd_mcu_is_halted(struct jtdev *p, struct comm *t, union arg_value *args) {
 	}
 }
 
+void cmd_jtag_speed(struct jtdev *p, struct comm *t, union arg_value *args) {
+	unsigned long hz = args[0].uint;
+
+	p->status = STATUS_OK;
+	unsigned long actual;
+	if (hz == 0) {
+		// Auto-tune on the next attach, keep the current speed until then
+		p->tck_auto = true;
+		actual = p->tck_hz;
+	} else {
+		p->tck_auto = false;
+		actual = jtag_set_speed(p, hz);
+	}
+	send_status(t, p->status);
+	if (p->status == STATUS_OK) {
+		send_address(t, actual);
+	}
+}
+
+void cmd_jtag_strobe_speed(struct jtdev *p, struct comm *t, union arg_value *args) {
+	unsigned long hz = args[0].uint;
+	if (hz < JTDEV_TCLK_STROBE_MIN_HZ || hz > JTDEV_TCLK_STROBE_MAX_HZ) {
+		send_status(t, STATUS_INVALID_ARGUMENTS);
+		return;
+	}
+
+	p->tclk_strobe_hz = hz;
+	send_status(t, STATUS_OK);
+	send_address(t, hz);
+}
+
+void cmd_jtag_transport(struct jtdev *p, struct comm *t, union arg_value *args) {
+	if (cmd_set_transport(p, args[0].symbol) < 0) {
+		send_status(t, STATUS_INVALID_ARGUMENTS);
+		return;
+	}
+	send_status(t, STATUS_OK);
+}
+
 void cmd_buf_capacity(struct jtdev *p, struct comm *t, union arg_value *args) {
 	(void)p;
 	(void)args;
@@ -213,9 +255,96 @@ void cmd_ram_verify(struct jtdev *p, struct comm *t, union arg_value *args) {
 	}
 
 	p->status = STATUS_OK;
-	// FIXME implement misaligned verify
-	int ok = jtag_verify_mem(p, address, nbytes / 2, (uint16_t *)(fet_buffer + offset));
-	send_status(t, ok ? p->status : STATUS_CONTENT_MISMATCH);
+	address_t mismatch = verify_memory(p, address, nbytes, fet_buffer + offset);
+	if (p->status == STATUS_OK && mismatch != ADDRESS_NONE) {
+		send_status(t, STATUS_CONTENT_MISMATCH);
+		send_address(t, mismatch);
+		return;
+	}
+	send_status(t, p->status);
+}
+
+// The PSA reads memory through instruction fetches, which have side effects
+// on the peripheral registers below this address, see quick_access_ok()
+#define SIGNATURE_START 0x0200
+
+void cmd_mem_signature(struct jtdev *p, struct comm *t, union arg_value *args) {
+	unsigned long address = args[0].uint;
+	unsigned long nbytes  = args[1].uint;
+	if ((address & 1) || (nbytes & 1)) {
+		send_status(t, STATUS_INVALID_ARGUMENTS);
+		return;
+	}
+	if (address < SIGNATURE_START || address > 0x10000 || nbytes > 0x10000 - address) {
+		send_status(t, STATUS_OUT_OF_BOUNDS);
+		return;
+	}
+
+	p->status = STATUS_OK;
+	uint16_t signature = signature_memory(p, address, nbytes / 2);
+
+	send_status(t, p->status);
+	if (p->status == STATUS_OK) {
+		send_address(t, signature);
+	}
+}
+
+void cmd_mem_crc(struct jtdev *p, struct comm *t, union arg_value *args) {
+	unsigned long address = args[0].uint;
+	unsigned long nbytes  = args[1].uint;
+	if (address > 0x10000 || nbytes > 0x10000 - address) {
+		send_status(t, STATUS_OUT_OF_BOUNDS);
+		return;
+	}
+
+	p->status = STATUS_OK;
+	uint16_t crc = crc_memory(p, address, nbytes);
+
+	send_status(t, p->status);
+	if (p->status == STATUS_OK) {
+		send_address(t, crc);
+	}
+}
+
+// The arguments of a funclet for R12-R15 follow its code in fet_buffer, as
+// little-endian 32-bit values. Its results are sent after the status line.
+#define FUNCLET_ARGS_BYTES (4 * 4)
+// Keeps the timeout well within the range of cmd_time_us()
+#define FUNCLET_MAX_TIMEOUT_MS 60000
+
+void cmd_funclet_run(struct jtdev *p, struct comm *t, union arg_value *args) {
+	unsigned long offset     = args[0].uint;
+	unsigned long code_len   = args[1].uint;
+	unsigned long address    = args[2].uint;
+	unsigned long entry      = args[3].uint;
+	unsigned long timeout_ms = args[4].uint;
+	if (offset >= FET_BUFFER_CAPACITY || code_len > FET_BUFFER_CAPACITY - offset
+	    || FUNCLET_ARGS_BYTES > FET_BUFFER_CAPACITY - offset - code_len) {
+		send_status(t, STATUS_OUT_OF_BOUNDS);
+		return;
+	}
+	if (timeout_ms > FUNCLET_MAX_TIMEOUT_MS) {
+		send_status(t, STATUS_INVALID_ARGUMENTS);
+		return;
+	}
+
+	address_t regs[4];
+	for (unsigned i = 0; i < 4; i++) {
+		regs[i] = LE_LONG(fet_buffer + offset + code_len, 4*i);
+	}
+
+	p->status = STATUS_OK;
+	if (run_funclet(p, address, fet_buffer + offset, code_len, entry, timeout_ms * 1000, regs) < 0) {
+		send_status(t, STATUS_OUT_OF_BOUNDS);
+		return;
+	}
+
+	send_status(t, p->status);
+	if (p->status == STATUS_OK) {
+		for (unsigned i = 0; i < 4; i++) {
+			send_address(t, regs[i]);
+		}
+	}
 }
 
 void cmd_flash_write(struct jtdev *p, struct comm *t, union arg_value *args) {
@@ -232,6 +361,95 @@ void cmd_flash_write(struct jtdev *p, struct comm *t, union arg_value *args) {
 	send_status(t, p->status);
 }
 
+void cmd_flash_loader(struct jtdev *p, struct comm *t, union arg_value *args) {
+	(void)p;
+
+	if (set_flash_loader(args[0].uint, args[1].uint, args[2].uint) < 0) {
+		send_status(t, STATUS_OUT_OF_BOUNDS);
+		return;
+	}
+	send_status(t, STATUS_OK);
+}
+
+void cmd_flash_blank_check(struct jtdev *p, struct comm *t, union arg_value *args) {
+	unsigned long offset       = args[0].uint;
+	unsigned long address      = args[1].uint;
+	unsigned long nbytes       = args[2].uint;
+	unsigned long segment_size = args[3].uint;
+	if ((address & 1) || (nbytes & 1) || segment_size == 0 || (segment_size & 1)) {
+		send_status(t, STATUS_INVALID_ARGUMENTS);
+		return;
+	}
+	unsigned long num_segments = (nbytes + segment_size - 1) / segment_size;
+	unsigned long bitmap_bytes = (num_segments + 7) / 8;
+	if (address > 0x10000 || nbytes > 0x10000 - address
+	    || offset >= FET_BUFFER_CAPACITY || bitmap_bytes > FET_BUFFER_CAPACITY - offset) {
+		send_status(t, STATUS_OUT_OF_BOUNDS);
+		return;
+	}
+
+	p->status = STATUS_OK;
+	blank_check_memory(p, address, nbytes, segment_size, fet_buffer + offset);
+	send_status(t, p->status);
+}
+
+void cmd_flash_sync(struct jtdev *p, struct comm *t, union arg_value *args) {
+	unsigned long offset       = args[0].uint;
+	unsigned long address      = args[1].uint;
+	unsigned long nbytes       = args[2].uint;
+	unsigned long segment_size = args[3].uint;
+	// Segment erasure works on whole segments only
+	if (segment_size == 0 || (segment_size & 1)
+	    || (address % segment_size) || (nbytes % segment_size)) {
+		send_status(t, STATUS_INVALID_ARGUMENTS);
+		return;
+	}
+	if (offset >= FET_BUFFER_CAPACITY || nbytes > FET_BUFFER_CAPACITY - offset
+	    || address > 0x10000 || nbytes > 0x10000 - address) {
+		send_status(t, STATUS_OUT_OF_BOUNDS);
+		return;
+	}
+
+	p->status = STATUS_OK;
+	address_t num_changed = sync_flash(p, address, nbytes, segment_size, fet_buffer + offset);
+
+	send_status(t, p->status);
+	if (p->status == STATUS_OK) {
+		send_address(t, num_changed);
+	}
+}
+
+// Ranges are pairs of little-endian 32-bit values, start address and length.
+#define FLASH_RANGE_BYTES 8
+#define FLASH_MAX_RANGES  64
+
+void cmd_flash_erase_ranges(struct jtdev *p, struct comm *t, union arg_value *args) {
+	unsigned long offset     = args[0].uint;
+	unsigned long num_ranges = args[1].uint;
+	if (num_ranges > FLASH_MAX_RANGES || offset >= FET_BUFFER_CAPACITY
+	    || num_ranges * FLASH_RANGE_BYTES > FET_BUFFER_CAPACITY - offset) {
+		send_status(t, STATUS_OUT_OF_BOUNDS);
+		return;
+	}
+
+	address_t ranges[2 * FLASH_MAX_RANGES];
+	for (unsigned i = 0; i < 2 * num_ranges; i++) {
+		ranges[i] = LE_LONG(fet_buffer + offset, 4*i);
+	}
+
+	p->status = STATUS_OK;
+	address_t num_erased;
+	if (erase_flash_ranges(p, ranges, num_ranges, &num_erased) < 0) {
+		send_status(t, STATUS_OUT_OF_BOUNDS);
+		return;
+	}
+
+	send_status(t, p->status);
+	if (p->status == STATUS_OK) {
+		send_address(t, num_erased);
+	}
+}
+
 void cmd_flash_erase_all(struct jtdev *p, struct comm *t, union arg_value *args) {
 	(void)args;
 
@@ -276,6 +494,50 @@ void cmd_reg_write(struct jtdev *p, struct comm *t, union arg_value *args) {
 	send_status(t, p->status);
 }
 
+// The register file is exchanged through fet_buffer as JTAG_NUM_REGS
+// little-endian 32-bit values, R0 first.
+#define REG_FILE_BYTES (JTAG_NUM_REGS * 4)
+
+void cmd_reg_read_all(struct jtdev *p, struct comm *t, union arg_value *args) {
+	unsigned long offset = args[0].uint;
+	if (offset >= FET_BUFFER_CAPACITY || REG_FILE_BYTES > FET_BUFFER_CAPACITY - offset) {
+		send_status(t, STATUS_OUT_OF_BOUNDS);
+		return;
+	}
+
+	address_t regs[JTAG_NUM_REGS];
+	p->status = STATUS_OK;
+	jtag_read_regs(p, regs);
+
+	unsigned char *buffer = fet_buffer + offset;
+	for (unsigned i = 0; i < JTAG_NUM_REGS; i++) {
+		buffer[4*i+0] = regs[i] & 0xff;
+		buffer[4*i+1] = (regs[i] >> 8) & 0xff;
+		buffer[4*i+2] = (regs[i] >> 16) & 0xff;
+		buffer[4*i+3] = (regs[i] >> 24) & 0xff;
+	}
+
+	send_status(t, p->status);
+}
+
+void cmd_reg_write_all(struct jtdev *p, struct comm *t, union arg_value *args) {
+	unsigned long offset = args[0].uint;
+	if (offset >= FET_BUFFER_CAPACITY || REG_FILE_BYTES > FET_BUFFER_CAPACITY - offset) {
+		send_status(t, STATUS_OUT_OF_BOUNDS);
+		return;
+	}
+
+	address_t regs[JTAG_NUM_REGS];
+	for (unsigned i = 0; i < JTAG_NUM_REGS; i++) {
+		regs[i] = LE_LONG(fet_buffer + offset, 4*i);
+	}
+
+	p->status = STATUS_OK;
+	jtag_write_regs(p, regs);
+
+	send_status(t, p->status);
+}
+
 void cmd_fuses_get_config(struct jtdev *p, struct comm *t, union arg_value *args) {
 	(void)args;
 
@@ -321,6 +583,17 @@ void cmd_version(struct jtdev *p, struct comm *t, union arg_value *args) {
 	send_address(t, version);
 }
 
+// Running a command and then this one times it on the device itself,
+// without the latency of the USB round trip. This is how scan rate
+// (RAM:READ) and flash programming throughput (FLASH:WRITE) are measured.
+void cmd_cmd_elapsed_us(struct jtdev *p, struct comm *t, union arg_value *args) {
+	(void)p;
+	(void)args;
+
+	send_status(t, STATUS_OK);
+	send_address(t, cmd_elapsed_us);
+}
+
 void cmd_help(struct jtdev *p, struct comm *t, union arg_value *args);
 
 const struct cmd_def cmd_defs[] = {
@@ -336,6 +609,12 @@ const struct cmd_def cmd_defs[] = {
 		cmd_version,
 		ATTACH_NOT_NEEDED
 	},
+	{
+		"CMD:ELAPSED_US",
+		{ NULL },
+		cmd_cmd_elapsed_us,
+		ATTACH_NOT_NEEDED
+	},
 	{
 		"MCU:ATTACH",
 		{ NULL },
@@ -384,6 +663,24 @@ const struct cmd_def cmd_defs[] = {
 		cmd_mcu_is_halted,
 		ATTACH_NOT_NEEDED
 	},
+	{
+		"JTAG:SPEED",
+		{ ARG_UINT "hz", NULL },
+		cmd_jtag_speed,
+		ATTACH_NOT_NEEDED
+	},
+	{
+		"JTAG:STROBE_SPEED",
+		{ ARG_UINT "hz", NULL },
+		cmd_jtag_strobe_speed,
+		ATTACH_NOT_NEEDED
+	},
+	{
+		"JTAG:TRANSPORT",
+		{ ARG_SYMBOL "transport", NULL },
+		cmd_jtag_transport,
+		ATTACH_NOT_NEEDED
+	},
 	{
 		"BUF:CAPACITY",
 		{ NULL },
@@ -420,12 +717,48 @@ const struct cmd_def cmd_defs[] = {
 		cmd_ram_verify,
 		0
 	},
+	{
+		"MEM:SIGNATURE",
+		{ ARG_UINT "address", ARG_UINT "num_bytes", NULL },
+		cmd_mem_signature,
+		0
+	},
+	{
+		"MEM:CRC",
+		{ ARG_UINT "address", ARG_UINT "num_bytes", NULL },
+		cmd_mem_crc,
+		0
+	},
+	{
+		"FUNCLET:RUN",
+		{ ARG_UINT "code_buf_offset", ARG_UINT "code_len", ARG_UINT "load_addr", ARG_UINT "entry", ARG_UINT "timeout_ms", NULL },
+		cmd_funclet_run,
+		0
+	},
 	{
 		"FLASH:WRITE",
 		{ ARG_UINT "buf_offset", ARG_UINT "address", ARG_UINT "num_bytes", NULL },
 		cmd_flash_write,
 		0
 	},
+	{
+		"FLASH:LOADER",
+		{ ARG_UINT "ram_address", ARG_UINT "ram_size", ARG_UINT "fctl2", NULL },
+		cmd_flash_loader,
+		ATTACH_NOT_NEEDED
+	},
+	{
+		"FLASH:BLANK_CHECK",
+		{ ARG_UINT "buf_offset", ARG_UINT "address", ARG_UINT "num_bytes", ARG_UINT "segment_size", NULL },
+		cmd_flash_blank_check,
+		0
+	},
+	{
+		"FLASH:SYNC",
+		{ ARG_UINT "buf_offset", ARG_UINT "address", ARG_UINT "num_bytes", ARG_UINT "segment_size", NULL },
+		cmd_flash_sync,
+		0
+	},
 	{
 		"FLASH:ERASE_ALL",
 		{ NULL },
@@ -438,6 +771,12 @@ const struct cmd_def cmd_defs[] = {
 		cmd_flash_erase_main,
 		0
 	},
+	{
+		"FLASH:ERASE_RANGES",
+		{ ARG_UINT "buf_offset", ARG_UINT "num_ranges", NULL },
+		cmd_flash_erase_ranges,
+		0
+	},
 	{
 		"FLASH:ERASE_SEG",
 		{ ARG_UINT "address", NULL },
@@ -456,6 +795,18 @@ const struct cmd_def cmd_defs[] = {
 		cmd_reg_write,
 		0
 	},
+	{
+		"REG:READ_ALL",
+		{ ARG_UINT "buf_offset", NULL },
+		cmd_reg_read_all,
+		0
+	},
+	{
+		"REG:WRITE_ALL",
+		{ ARG_UINT "buf_offset", NULL },
+		cmd_reg_write_all,
+		0
+	},
 	{
 		"FUSES:GET_CONFIG",
 		{ NULL },
@@ -567,7 +918,14 @@ void process_command(struct jtdev *p, struct comm *t, char *line) {
 		}
 	}
 
+	if (cmd->func == cmd_cmd_elapsed_us) {
+		cmd->func(p, t, args);
+		return;
+	}
+
+	unsigned long start = cmd_time_us();
 	cmd->func(p, t, args);
+	cmd_elapsed_us = cmd_time_us() - start;
 }
 
 void command_loop(struct jtdev *p, struct comm *t) {
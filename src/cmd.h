@@ -8,6 +8,14 @@ struct comm; // declared somewhere else
 
 extern unsigned char fet_buffer[FET_BUFFER_CAPACITY];
 
+// Free-running microsecond counter, provided by the platform code
+unsigned long cmd_time_us(void);
+
+// Switch the JTAG device over to the named transport ("JTAG" or "SBW"),
+// provided by the platform code. Returns 0 on success or -1 if the
+// transport is unknown or unavailable.
+int cmd_set_transport(struct jtdev *p, const char *name);
+
 void send_status(struct comm *t, int status);
 void command_loop(struct jtdev *p, struct comm *t);
 
@@ -73,41 +73,288 @@
 #define IR_EMEX_WRITE_CONTROL	0x30 /* 0x0C */
 #define IR_EMEX_READ_CONTROL	0xD0 /* 0x0B */
 
-#define jtag_tms_set(p)		p->f->jtdev_tms(p, 1)
-#define jtag_tms_clr(p)		p->f->jtdev_tms(p, 0)
-#define jtag_tck_set(p)		p->f->jtdev_tck(p, 1)
-#define jtag_tck_clr(p)		p->f->jtdev_tck(p, 0)
-#define jtag_tdi_set(p)		p->f->jtdev_tdi(p, 1)
-#define jtag_tdi_clr(p)		p->f->jtdev_tdi(p, 0)
-#define jtag_tclk_set(p)	p->f->jtdev_tclk(p, 1)
-#define jtag_tclk_clr(p)	p->f->jtdev_tclk(p, 0)
-#define jtag_rst_set(p)		p->f->jtdev_rst(p, 1)
-#define jtag_rst_clr(p)		p->f->jtdev_rst(p, 0)
-#define jtag_tst_set(p)		p->f->jtdev_tst(p, 1)
-#define jtag_tst_clr(p)		p->f->jtdev_tst(p, 0)
+/* JTAG clock frequencies tried by jtag_tune_speed(), in ascending order.
+ * The first one is used to attach and is the lower limit when slowing down.
+ */
+static const unsigned long jtag_tune_steps[] = {
+	250000, 500000, 1000000, 2000000, 4000000, 6000000, 8000000, 10000000
+};
+
+/* First word of RAM on all flash devices, used for read-after-write tests */
+#define JTAG_TUNE_SCRATCH_ADDR	0x0200
+
+/* Flash controller status register and its BUSY, ACCVIFG and WAIT bits */
+#define FCTL3			0x012C
+#define FCTL3_BUSY		0x0001
+#define FCTL3_ACCVIFG		0x0004
+#define FCTL3_WAIT		0x0008
+
+/* TCLK strobes for flash word writes and erasures. The flash timing
+ * generator needs 30 cycles per word on 2xx devices and 33 on F149/F449;
+ * a segment erase takes 4819 cycles and a mass erase up to 10593 (2xx).
+ * Strobes are issued in bursts, polling BUSY in between, until the flash
+ * controller is done. The maximum only guards against a hung controller.
+ */
+#define FLASH_WORD_STROBES_MIN		30
+#define FLASH_WORD_STROBES_STEP		2
+#define FLASH_WORD_STROBES_MAX		100
+#define FLASH_ERASE_STROBES_MIN		4096
+#define FLASH_ERASE_STROBES_STEP	256
+#define FLASH_ERASE_STROBES_MAX		12000
+
+/* TCLK strobes for the words of a block write: the flash timing generator
+ * takes 25 cycles for the first word on 2xx devices and 30 on F1xx/F4xx,
+ * and 18 for each following one, after which the WAIT bit is set again.
+ * WAIT is polled from the 2xx counts on. Ending the block takes another
+ * 6 cycles.
+ */
+#define FLASH_BLOCK_FIRST_STROBES	25
+#define FLASH_BLOCK_NEXT_STROBES	18
+#define FLASH_BLOCK_END_STROBES		6
+
+/* The programming voltage stays on across a block, and the cumulative
+ * program time of a row must stay below 4 ms (F1xx). Each word takes about
+ * 200 TCK cycles of scans, including the WAIT poll, on top of its strobes,
+ * which is only fast enough for that from this TCK frequency.
+ */
+#define FLASH_BLOCK_MIN_TCK_HZ		6000000
+
+/* Larger flash memories (F1xx/F4xx) need a cumulative mass erase time of
+ * 200 ms, so mass and main erasures are repeated until that many strobes,
+ * sized for the fastest flash timing generator, have been issued.
+ */
+#define FLASH_MASS_ERASE_STROBES	(19 * 5300)
+
+/* Watchdog control register, password and hold bit */
+#define WDTCTL			0x0120
+#define WDTPW			0x5A00
+#define WDTHOLD			0x0080
+
+/* Run whatever is still queued before accessing the JTAG port directly */
+static inline struct jtdev *jtag_sync(struct jtdev *p)
+{
+	if (p->queue_count)
+		jtag_queue_flush(p);
+	return p;
+}
+
+#ifdef PICOFET_STATIC_JTDEV
+/* The backend is fixed at build time. Its primitives are called directly,
+ * so that the compiler can inline them into the shift loops.
+ */
+#include "pico_sio.h"
+
+#define jtag_dev_tck(p, out)		sio_dev_tck(p, out)
+#define jtag_dev_tms(p, out)		sio_dev_tms(p, out)
+#define jtag_dev_tdi(p, out)		sio_dev_tdi(p, out)
+#define jtag_dev_tdo_get(p)		sio_dev_tdo_get(p)
+#define jtag_dev_tclk(p, out)		sio_dev_tclk(p, out)
+#define jtag_dev_tclk_get(p)		sio_dev_tclk_get(p)
+#define jtag_dev_ir_shift(p, ir)	sio_dev_ir_shift(p, ir)
+#define jtag_dev_dr_shift_8(p, dr)	sio_dev_dr_shift_8(p, dr)
+#define jtag_dev_dr_shift_16(p, dr)	sio_dev_dr_shift_16(p, dr)
+#define jtag_dev_dr_write_16(p, dr)	sio_dev_dr_write_16(p, dr)
+#define jtag_dev_dr_capture_16(p)	sio_dev_dr_capture_16(p)
+#define jtag_dev_tms_sequence(p, bits, tms) sio_dev_tms_sequence(p, bits, tms)
+#define jtag_dev_run_queue(p, ops, count) jtag_default_run_queue(p, ops, count)
+#else
+#define jtag_dev_tck(p, out)		(p)->f->jtdev_tck(p, out)
+#define jtag_dev_tms(p, out)		(p)->f->jtdev_tms(p, out)
+#define jtag_dev_tdi(p, out)		(p)->f->jtdev_tdi(p, out)
+#define jtag_dev_tdo_get(p)		(p)->f->jtdev_tdo_get(p)
+#define jtag_dev_tclk(p, out)		(p)->f->jtdev_tclk(p, out)
+#define jtag_dev_tclk_get(p)		(p)->f->jtdev_tclk_get(p)
+#define jtag_dev_ir_shift(p, ir)	(p)->f->jtdev_ir_shift(p, ir)
+#define jtag_dev_dr_shift_8(p, dr)	(p)->f->jtdev_dr_shift_8(p, dr)
+#define jtag_dev_dr_shift_16(p, dr)	(p)->f->jtdev_dr_shift_16(p, dr)
+#define jtag_dev_dr_write_16(p, dr)	(p)->f->jtdev_dr_write_16(p, dr)
+#define jtag_dev_dr_capture_16(p)	(p)->f->jtdev_dr_capture_16(p)
+#define jtag_dev_tms_sequence(p, bits, tms) (p)->f->jtdev_tms_sequence(p, bits, tms)
+#define jtag_dev_run_queue(p, ops, count) (p)->f->jtdev_run_queue(p, ops, count)
+#endif
+
+#define jtag_tms_set(p)		(jtag_sync(p), jtag_dev_tms(p, 1))
+#define jtag_tms_clr(p)		(jtag_sync(p), jtag_dev_tms(p, 0))
+#define jtag_tck_set(p)		(jtag_sync(p), jtag_dev_tck(p, 1))
+#define jtag_tck_clr(p)		(jtag_sync(p), jtag_dev_tck(p, 0))
+#define jtag_tdi_set(p)		(jtag_sync(p), jtag_dev_tdi(p, 1))
+#define jtag_tdi_clr(p)		(jtag_sync(p), jtag_dev_tdi(p, 0))
+#define jtag_tclk_set(p)	(jtag_tap_idle(p), jtag_dev_tclk(p, 1))
+#define jtag_tclk_clr(p)	(jtag_tap_idle(p), jtag_dev_tclk(p, 0))
+#define jtag_tclk_strobe(p, n)	jtag_tap_idle(p)->f->jtdev_tclk_strobe(p, n)
+#define jtag_rst_set(p)		jtag_sync(p)->f->jtdev_rst(p, 1)
+#define jtag_rst_clr(p)		jtag_sync(p)->f->jtdev_rst(p, 0)
+#define jtag_tst_set(p)		jtag_sync(p)->f->jtdev_tst(p, 1)
+#define jtag_tst_clr(p)		jtag_sync(p)->f->jtdev_tst(p, 0)
 
 #define jtag_led_green_on(p)	p->f->jtdev_led_green(p, 1)
 #define jtag_led_green_off(p)	p->f->jtdev_led_green(p, 0)
 #define jtag_led_red_on(p)	p->f->jtdev_led_red(p, 1)
 #define jtag_led_red_off(p)	p->f->jtdev_led_red(p, 0)
 
-#define jtag_ir_shift(p, ir) p->f->jtdev_ir_shift(p, ir)
-#define jtag_dr_shift_8(p, dr) p->f->jtdev_dr_shift_8(p, dr)
-#define jtag_dr_shift_16(p, dr) p->f->jtdev_dr_shift_16(p, dr)
-#define jtag_tms_sequence(p, bits, tms) p->f->jtdev_tms_sequence(p, bits, tms)
-#define jtag_init_dap(p) p->f->jtdev_init_dap(p)
+#define jtag_ir_shift(p, ir) jtag_checked_ir_shift(p, ir)
+#define jtag_dr_shift_8(p, dr) \
+	(jtag_tap_scan(p, JTAG_TAP_UPDATE_DR, 0), jtag_dev_dr_shift_8(p, dr))
+#define jtag_dr_shift_16(p, dr) \
+	(jtag_tap_scan(p, JTAG_TAP_UPDATE_DR, 0), jtag_dev_dr_shift_16(p, dr))
+#define jtag_dr_write_16(p, dr) \
+	(jtag_tap_scan(p, JTAG_TAP_UPDATE_DR, 0), jtag_dev_dr_write_16(p, dr))
+#define jtag_dr_capture_16(p) \
+	(jtag_tap_scan(p, JTAG_TAP_UPDATE_DR, 0), jtag_dev_dr_capture_16(p))
+#define jtag_tms_sequence(p, bits, tms) jtag_tap_sequence(p, bits, tms, 0)
+#define jtag_init_dap(p) (jtag_ir_invalidate(p),			\
+			  jtag_sync(p)->f->jtdev_init_dap(p),		\
+			  (void)((p)->tap_state = JTAG_TAP_IDLE))
+
+/* Forget which instruction the IR holds, so that the next IR scan for any
+ * instruction actually takes place */
+#define jtag_ir_invalidate(p)	((p)->ir_cache = -1)
+
+static void jtag_queue_op(struct jtdev *p, uint8_t type, uint8_t bits,
+			  uint16_t value, uint16_t *result);
+
+/* Next TAP state for TMS low and TMS high */
+static const uint8_t jtag_tap_next[JTAG_TAP_NUM_STATES][2] = {
+	[JTAG_TAP_RESET]      = { JTAG_TAP_IDLE,       JTAG_TAP_RESET },
+	[JTAG_TAP_IDLE]       = { JTAG_TAP_IDLE,       JTAG_TAP_SELECT_DR },
+	[JTAG_TAP_SELECT_DR]  = { JTAG_TAP_CAPTURE_DR, JTAG_TAP_SELECT_IR },
+	[JTAG_TAP_CAPTURE_DR] = { JTAG_TAP_SHIFT_DR,   JTAG_TAP_EXIT1_DR },
+	[JTAG_TAP_SHIFT_DR]   = { JTAG_TAP_SHIFT_DR,   JTAG_TAP_EXIT1_DR },
+	[JTAG_TAP_EXIT1_DR]   = { JTAG_TAP_PAUSE_DR,   JTAG_TAP_UPDATE_DR },
+	[JTAG_TAP_PAUSE_DR]   = { JTAG_TAP_PAUSE_DR,   JTAG_TAP_EXIT2_DR },
+	[JTAG_TAP_EXIT2_DR]   = { JTAG_TAP_SHIFT_DR,   JTAG_TAP_UPDATE_DR },
+	[JTAG_TAP_UPDATE_DR]  = { JTAG_TAP_IDLE,       JTAG_TAP_SELECT_DR },
+	[JTAG_TAP_SELECT_IR]  = { JTAG_TAP_CAPTURE_IR, JTAG_TAP_RESET },
+	[JTAG_TAP_CAPTURE_IR] = { JTAG_TAP_SHIFT_IR,   JTAG_TAP_EXIT1_IR },
+	[JTAG_TAP_SHIFT_IR]   = { JTAG_TAP_SHIFT_IR,   JTAG_TAP_EXIT1_IR },
+	[JTAG_TAP_EXIT1_IR]   = { JTAG_TAP_PAUSE_IR,   JTAG_TAP_UPDATE_IR },
+	[JTAG_TAP_PAUSE_IR]   = { JTAG_TAP_PAUSE_IR,   JTAG_TAP_EXIT2_IR },
+	[JTAG_TAP_EXIT2_IR]   = { JTAG_TAP_SHIFT_IR,   JTAG_TAP_UPDATE_IR },
+	[JTAG_TAP_UPDATE_IR]  = { JTAG_TAP_IDLE,       JTAG_TAP_SELECT_DR },
+};
+
+/* Clocks a TMS sequence, first level in bit 0, and follows the TAP state
+ * through it. Five cycles with TMS high reach Test-Logic-Reset from any
+ * state, even an unknown one.
+ * queued: add the sequence to the transaction queue instead of running it
+ */
+static void jtag_tap_sequence(struct jtdev *p, int bits, unsigned int tms,
+			      int queued)
+{
+	int index, high, ones = 0;
+
+	if (bits <= 0)
+		return;
+
+	if (queued)
+		jtag_queue_op(p, JTAG_OP_TMS_SEQUENCE, bits, tms, NULL);
+	else
+		(jtag_sync(p), jtag_dev_tms_sequence(p, bits, tms));
+
+	for (index = 0; index < bits; index++) {
+		high = (tms >> index) & 1;
+		ones = high ? ones + 1 : 0;
+
+		if (ones >= 5)
+			p->tap_state = JTAG_TAP_RESET;
+		else if (p->tap_state != JTAG_TAP_UNKNOWN)
+			p->tap_state = jtag_tap_next[p->tap_state][high];
+
+		/* Test-Logic-Reset resets the instruction register */
+		if (p->tap_state == JTAG_TAP_RESET)
+			jtag_ir_invalidate(p);
+	}
+}
+
+/* Moves the TAP to the given state on the shortest TMS path, found by a
+ * breadth-first search of the state graph. Coming from an unknown state,
+ * the path starts with a TAP reset.
+ * queued: add the path to the transaction queue instead of running it
+ */
+static void jtag_tap_goto(struct jtdev *p, uint8_t state, int queued)
+{
+	uint8_t length[JTAG_TAP_NUM_STATES];
+	unsigned int path[JTAG_TAP_NUM_STATES];
+	uint8_t fifo[JTAG_TAP_NUM_STATES];
+	unsigned int head = 0, tail = 0;
+	unsigned int reset_bits = 0;
+	uint8_t from = p->tap_state;
+	uint8_t current, next;
+	int index, high;
+
+	if (from == state)
+		return;
+
+	if (from == JTAG_TAP_UNKNOWN) {
+		reset_bits = 5;
+		from = JTAG_TAP_RESET;
+	}
+
+	for (index = 0; index < JTAG_TAP_NUM_STATES; index++)
+		length[index] = 0xff;
+	length[from] = 0;
+	path[from] = 0;
+	fifo[tail++] = from;
+
+	while (head < tail) {
+		current = fifo[head++];
+		for (high = 0; high < 2; high++) {
+			next = jtag_tap_next[current][high];
+			if (length[next] != 0xff)
+				continue;
+			length[next] = length[current] + 1;
+			path[next] = path[current] | ((unsigned int)high << length[current]);
+			fifo[tail++] = next;
+		}
+	}
+
+	jtag_tap_sequence(p, reset_bits + length[state],
+			  ((1u << reset_bits) - 1) | (path[state] << reset_bits),
+			  queued);
+}
+
+/* Moves the TAP to Run-Test/Idle, where TCLK can be changed */
+static inline struct jtdev *jtag_tap_idle(struct jtdev *p)
+{
+	jtag_tap_goto(p, JTAG_TAP_IDLE, 0);
+	return jtag_sync(p);
+}
+
+/* Prepares the TAP for an IR or DR scan ending in the given Update state.
+ * Scans start right away from Run-Test/Idle or the Update state of the
+ * previous scan, any other state moves to Run-Test/Idle first.
+ * queued: the scan is going to the transaction queue
+ */
+static inline struct jtdev *jtag_tap_scan(struct jtdev *p, uint8_t update,
+					  int queued)
+{
+	if (p->tap_state != JTAG_TAP_IDLE &&
+	    p->tap_state != JTAG_TAP_UPDATE_DR &&
+	    p->tap_state != JTAG_TAP_UPDATE_IR)
+		jtag_tap_goto(p, JTAG_TAP_IDLE, queued);
+
+	p->tap_state = update;
+	return queued ? p : jtag_sync(p);
+}
 
 #define jtag_fail(p, sts) do {			\
 		(p)->status = (sts);		\
 		(p)->attached = false;		\
+		(p)->jtag_id = 0;		\
+		(p)->ir_cache = -1;		\
+		(p)->cpu_halted = false;	\
 		jtag_led_green_off(p);		\
 	} while (0)
 
+static uint8_t jtag_checked_ir_shift(struct jtdev *p, uint8_t ir);
+
 /* Reset target JTAG interface and perform fuse-HW check */
 static void jtag_default_reset_tap(struct jtdev *p)
 {
 	int loop_counter;
 
+	jtag_ir_invalidate(p);
+
 	/* TODO: replace with tms_sequence()? */
 	jtag_tms_set(p);
 	jtag_tck_set(p);
@@ -133,38 +380,23 @@ static void jtag_default_reset_tap(struct jtdev *p)
 	jtag_tck_set(p);
 }
 
-/* This function sets the target JTAG state machine
- * back into the Run-Test/Idle state after a shift access
- */
-static void jtag_default_tclk_prep (struct jtdev *p)
-{
-	/* JTAG state = Exit-DR */
-	jtag_tck_clr(p);
-	jtag_tck_set(p);
-
-	/* JTAG state = Update-DR */
-	jtag_tms_clr(p);
-	jtag_tck_clr(p);
-	jtag_tck_set(p);
-
-	/* JTAG state = Run-Test/Idle */
-}
-
 /* Shift a value into TDI (MSB first) and simultaneously
  * shift out a value from TDO (MSB first)
  * num_bits: number of bits to shift
  * data_out: data to be shifted out
- * return  : scanned TDO value
+ * capture : whether to sample TDO at all
+ * return  : scanned TDO value, 0 if not captured
  */
 static unsigned int jtag_default_shift( struct jtdev *p,
 				unsigned char num_bits,
-				unsigned int  data_out )
+				unsigned int  data_out,
+				int           capture )
 {
 	unsigned int data_in;
 	unsigned int mask;
 	unsigned int tclk_save;
 
-	tclk_save = p->f->jtdev_tclk_get(p);
+	tclk_save = jtag_dev_tclk_get(p);
 
 	data_in = 0;
 	for (mask = 0x0001U << (num_bits - 1); mask != 0; mask >>= 1) {
@@ -179,14 +411,15 @@ static unsigned int jtag_default_shift( struct jtdev *p,
 		jtag_tck_clr(p);
 		jtag_tck_set(p);
 
-		if (p->f->jtdev_tdo_get(p) == 1)
+		if (capture && jtag_dev_tdo_get(p) == 1)
 			data_in |= mask;
 	}
 
-	p->f->jtdev_tclk(p, tclk_save);
+	jtag_dev_tclk(p, tclk_save);
 
-	/* Set JTAG state back to Run-Test/Idle */
-	jtag_default_tclk_prep(p);
+	/* JTAG state = Exit1-xR -> Update-xR, TMS is still high */
+	jtag_tck_clr(p);
+	jtag_tck_set(p);
 
 	return data_in;
 }
@@ -198,7 +431,7 @@ static unsigned int jtag_default_shift( struct jtdev *p,
  */
 uint8_t jtag_default_ir_shift(struct jtdev *p, uint8_t instruction)
 {
-	/* JTAG state = Run-Test/Idle */
+	/* JTAG state = Run-Test/Idle or Update-xR */
 	jtag_tms_set(p);
 	jtag_tck_clr(p);
 	jtag_tck_set(p);
@@ -217,18 +450,16 @@ uint8_t jtag_default_ir_shift(struct jtdev *p, uint8_t instruction)
 	jtag_tck_set(p);
 
 	/* JTAG state = Shift-IR, Shift in TDI (8-bit) */
-	return jtag_default_shift(p, 8, instruction);
+	return jtag_default_shift(p, 8, instruction, 1);
 
-	/* JTAG state = Run-Test/Idle */
+	/* JTAG state = Update-IR */
 }
 
-/* Shifts a given 8-bit byte into the JTAG data register through TDI.
- * data  : 8 bit data
- * return: scanned TDO value
- */
-uint8_t jtag_default_dr_shift_8(struct jtdev *p, uint8_t data)
+/* Moves the target JTAG state machine from Run-Test/Idle or Update-xR
+ * to Shift-DR */
+static void jtag_default_goto_shift_dr(struct jtdev *p)
 {
-	/* JTAG state = Run-Test/Idle */
+	/* JTAG state = Run-Test/Idle or Update-xR */
 	jtag_tms_set(p);
 	jtag_tck_clr(p);
 	jtag_tck_set(p);
@@ -242,10 +473,21 @@ uint8_t jtag_default_dr_shift_8(struct jtdev *p, uint8_t data)
 	jtag_tck_clr(p);
 	jtag_tck_set(p);
 
-	/* JTAG state = Shift-DR, Shift in TDI (16-bit) */
-	return jtag_default_shift(p, 8, data);
+	/* JTAG state = Shift-DR */
+}
+
+/* Shifts a given 8-bit byte into the JTAG data register through TDI.
+ * data  : 8 bit data
+ * return: scanned TDO value
+ */
+uint8_t jtag_default_dr_shift_8(struct jtdev *p, uint8_t data)
+{
+	jtag_default_goto_shift_dr(p);
+
+	/* JTAG state = Shift-DR, Shift in TDI (8-bit) */
+	return jtag_default_shift(p, 8, data, 1);
 
-	/* JTAG state = Run-Test/Idle */
+	/* JTAG state = Update-DR */
 }
 
 /* Shifts a given 16-bit word into the JTAG data register through TDI.
@@ -254,24 +496,39 @@ uint8_t jtag_default_dr_shift_8(struct jtdev *p, uint8_t data)
  */
 uint16_t jtag_default_dr_shift_16(struct jtdev *p, uint16_t data)
 {
-	/* JTAG state = Run-Test/Idle */
-	jtag_tms_set(p);
-	jtag_tck_clr(p);
-	jtag_tck_set(p);
+	jtag_default_goto_shift_dr(p);
 
-	/* JTAG state = Select DR-Scan */
-	jtag_tms_clr(p);
-	jtag_tck_clr(p);
-	jtag_tck_set(p);
+	/* JTAG state = Shift-DR, Shift in TDI (16-bit) */
+	return jtag_default_shift(p, 16, data, 1);
 
-	/* JTAG state = Capture-DR */
-	jtag_tck_clr(p);
-	jtag_tck_set(p);
+	/* JTAG state = Update-DR */
+}
+
+/* Shifts a given 16-bit word into the JTAG data register through TDI,
+ * without sampling TDO.
+ * data  : 16 bit data
+ */
+void jtag_default_dr_write_16(struct jtdev *p, uint16_t data)
+{
+	jtag_default_goto_shift_dr(p);
 
 	/* JTAG state = Shift-DR, Shift in TDI (16-bit) */
-	return jtag_default_shift(p, 16, data);
+	jtag_default_shift(p, 16, data, 0);
 
-	/* JTAG state = Run-Test/Idle */
+	/* JTAG state = Update-DR */
+}
+
+/* Reads the 16-bit JTAG data register, shifting in zeros.
+ * return: scanned TDO value
+ */
+uint16_t jtag_default_dr_capture_16(struct jtdev *p)
+{
+	jtag_default_goto_shift_dr(p);
+
+	/* JTAG state = Shift-DR, Shift out TDO (16-bit) */
+	return jtag_default_shift(p, 16, 0x0000, 1);
+
+	/* JTAG state = Update-DR */
 }
 
 void jtag_default_tms_sequence(struct jtdev *p, int bits, unsigned int value)
@@ -293,7 +550,7 @@ void jtag_default_init_dap(struct jtdev *p)
 	jtag_tdi_set(p);
 	jtag_tms_set(p);
 	jtag_tck_set(p);
-	jtag_tclk_set(p);
+	jtag_dev_tclk(p, 1);
 
 	jtag_rst_set(p);
 	jtag_tst_clr(p);
@@ -309,6 +566,177 @@ void jtag_default_init_dap(struct jtdev *p)
 	jtag_default_reset_tap(p);
 }
 
+/* Runs queued operations one by one through the regular jtdev routines */
+void jtag_default_run_queue(struct jtdev *p, const struct jtag_op *ops,
+			    unsigned int count)
+{
+	unsigned int index;
+	uint16_t value;
+
+	for (index = 0; index < count; index++) {
+		const struct jtag_op *op = &ops[index];
+
+		value = 0;
+		switch (op->type) {
+		case JTAG_OP_IR_SHIFT:
+			value = jtag_dev_ir_shift(p, op->value);
+			break;
+		case JTAG_OP_DR_SHIFT:
+			if (op->bits == 8)
+				value = jtag_dev_dr_shift_8(p, op->value);
+			else if (!op->result)
+				jtag_dev_dr_write_16(p, op->value);
+			else
+				value = jtag_dev_dr_shift_16(p, op->value);
+			break;
+		case JTAG_OP_TCLK:
+			jtag_dev_tclk(p, op->value);
+			break;
+		case JTAG_OP_TMS_SEQUENCE:
+			jtag_dev_tms_sequence(p, op->bits, op->value);
+			break;
+		}
+
+		if (op->result)
+			*op->result = value;
+	}
+}
+
+/* Appends an operation to the transaction queue */
+static void jtag_queue_op(struct jtdev *p, uint8_t type, uint8_t bits,
+			  uint16_t value, uint16_t *result)
+{
+	struct jtag_op *op;
+
+	if (p->queue_count == JTDEV_QUEUE_CAPACITY)
+		jtag_queue_flush(p);
+
+	/* IR scans always capture, to be checked against the JTAG ID */
+	if (type == JTAG_OP_IR_SHIFT)
+		result = &p->queue_ir_capture[p->queue_count];
+
+	op = &p->queue[p->queue_count++];
+	op->type   = type;
+	op->bits   = bits;
+	op->value  = value;
+	op->result = result;
+}
+
+/* Skipped if the IR will already hold the instruction, see
+ * jtag_checked_ir_shift() */
+void jtag_queue_ir_shift(struct jtdev *p, uint8_t ir)
+{
+	if (p->jtag_id && p->ir_cache == ir)
+		return;
+
+	jtag_tap_scan(p, JTAG_TAP_UPDATE_IR, 1);
+	jtag_queue_op(p, JTAG_OP_IR_SHIFT, 8, ir, NULL);
+	p->ir_cache = ir;
+}
+
+void jtag_queue_dr_shift_16(struct jtdev *p, uint16_t dr, uint16_t *result)
+{
+	jtag_tap_scan(p, JTAG_TAP_UPDATE_DR, 1);
+	jtag_queue_op(p, JTAG_OP_DR_SHIFT, 16, dr, result);
+}
+
+void jtag_queue_tclk(struct jtdev *p, int out)
+{
+	jtag_tap_goto(p, JTAG_TAP_IDLE, 1);
+	jtag_queue_op(p, JTAG_OP_TCLK, 0, out, NULL);
+}
+
+void jtag_queue_tms_sequence(struct jtdev *p, int bits, unsigned int value)
+{
+	jtag_tap_sequence(p, bits, value, 1);
+}
+
+/* Halves the JTAG clock frequency after a link error in auto-tune mode
+ * return: 1 - clock was slowed down, the operation should be retried
+ *         0 - clock is at its lower limit or fixed
+ */
+static int jtag_slow_down(struct jtdev *p)
+{
+	if (!p->tck_auto || p->tck_hz <= jtag_tune_steps[0])
+		return 0;
+
+	/* The failed operation may have loaded a corrupted instruction */
+	jtag_ir_invalidate(p);
+	jtag_set_speed(p, p->tck_hz / 2);
+	return 1;
+}
+
+/* Shifts an instruction and checks the captured value against the JTAG ID
+ * of the attached device. A mismatch means that the link is unreliable, so
+ * the instruction is shifted again at a lower clock frequency.
+ *
+ * Once the JTAG ID is known, the scan is skipped if the IR already holds
+ * the instruction, and the JTAG ID is returned as the captured value.
+ */
+static uint8_t jtag_checked_ir_shift(struct jtdev *p, uint8_t ir)
+{
+	uint8_t jtag_id;
+
+	if (p->jtag_id && p->ir_cache == ir)
+		return p->jtag_id;
+
+	for (;;) {
+		jtag_id = (jtag_tap_scan(p, JTAG_TAP_UPDATE_IR, 0),
+			   jtag_dev_ir_shift(p, ir));
+		if (!p->jtag_id || jtag_id == p->jtag_id) {
+			p->ir_cache = ir;
+			return jtag_id;
+		}
+		if (!jtag_slow_down(p)) {
+			jtag_ir_invalidate(p);
+			return jtag_id;
+		}
+	}
+}
+
+/* Checks the values captured by the queued IR scans against the JTAG ID
+ * return: 1 - all of them match, or the JTAG ID is not known yet
+ *         0 - the link corrupted at least one scan
+ */
+static int jtag_queue_ir_ok(struct jtdev *p, unsigned int count)
+{
+	unsigned int index;
+
+	if (!p->jtag_id)
+		return 1;
+
+	for (index = 0; index < count; index++)
+		if (p->queue[index].type == JTAG_OP_IR_SHIFT &&
+		    p->queue_ir_capture[index] != p->jtag_id)
+			return 0;
+
+	return 1;
+}
+
+/* Runs all queued operations in one burst. As with jtag_checked_ir_shift(),
+ * a captured IR value that doesn't match the JTAG ID means that the link is
+ * unreliable, and the clock is slowed down. A burst may step the PC, clock
+ * the PSA or program flash, so it can't simply run again: the operation
+ * fails instead, to be retried as a whole at the lower frequency.
+ */
+void jtag_queue_flush(struct jtdev *p)
+{
+	unsigned int count = p->queue_count;
+
+	if (count == 0)
+		return;
+
+	p->queue_count = 0;
+	jtag_dev_run_queue(p, p->queue, count);
+	if (jtag_queue_ir_ok(p, count))
+		return;
+
+	jtag_slow_down(p);
+	jtag_ir_invalidate(p);
+	if (p->status == STATUS_OK)
+		p->status = STATUS_TRANSFER_FAILED;
+}
+
 /* Set target CPU JTAG state machine into the instruction fetch state
  * return: 1 - instruction fetch was set
  *         0 - otherwise
@@ -317,60 +745,133 @@ static int jtag_set_instruction_fetch(struct jtdev *p)
 {
 	unsigned int loop_counter;
 
-	jtag_ir_shift(p, IR_CNTRL_SIG_CAPTURE);
-	/* Wait until CPU is in instruction fetch state
-	 * timeout after limited attempts
-	 */
-	for (loop_counter = 50; loop_counter > 0; loop_counter--) {
-		if ((jtag_dr_shift_16(p, 0x0000) & 0x0080) == 0x0080)
-			return 1;
+	do {
+		jtag_ir_shift(p, IR_CNTRL_SIG_CAPTURE);
+		/* Wait until CPU is in instruction fetch state
+		 * timeout after limited attempts
+		 */
+		for (loop_counter = 50; loop_counter > 0; loop_counter--) {
+			if ((jtag_dr_capture_16(p) & 0x0080) == 0x0080)
+				return 1;
 
-		jtag_tclk_clr(p); /* The TCLK pulse befor jtag_dr_shift_16 leads to   */
-		jtag_tclk_set(p); /* problems at MEM_QUICK_READ, it's from SLAU265 */
-	}
+			jtag_tclk_clr(p); /* The TCLK pulse befor jtag_dr_shift_16 leads to   */
+			jtag_tclk_set(p); /* problems at MEM_QUICK_READ, it's from SLAU265 */
+		}
+	} while (jtag_slow_down(p));
 
 	jtag_fail(p, STATUS_TIMED_OUT);
 
 	return 0;
 }
 
-/* Set the CPU into a controlled stop state */
+/* Set the CPU into a controlled stop state. The CPU stays there, with
+ * TCLK high, across memory and flash accesses until jtag_release_cpu(), so
+ * that consecutive accesses only cost their address and data scans.
+ */
 static void jtag_halt_cpu(struct jtdev *p)
 {
+	if (p->cpu_halted)
+		return;
+
 	/* Set CPU into instruction fetch mode */
-	jtag_set_instruction_fetch(p);
+	if (!jtag_set_instruction_fetch(p))
+		return;
 
 	/* Set device into JTAG mode + read */
-	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x2401);
+	jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_queue_dr_shift_16(p, 0x2401, NULL);
 
 	/* Send JMP $ instruction to keep CPU from changing the state */
-	jtag_ir_shift(p, IR_DATA_16BIT);
-	jtag_dr_shift_16(p, 0x3FFF);
-	jtag_tclk_set(p);
-	jtag_tclk_clr(p);
+	jtag_queue_ir_shift(p, IR_DATA_16BIT);
+	jtag_queue_dr_shift_16(p, 0x3FFF, NULL);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_tclk(p, 0);
 
 	/* Set JTAG_HALT bit */
-	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x2409);
-	jtag_tclk_set(p);
+	jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_queue_dr_shift_16(p, 0x2409, NULL);
+	jtag_queue_tclk(p, 1);
+	p->cpu_halted = true;
 }
 
-/* Release the target CPU from the controlled stop state */
+/* Release the target CPU from the controlled stop state, if it is in it.
+ * Needed before anything that has the CPU execute instructions.
+ */
 static void jtag_release_cpu(struct jtdev *p)
 {
-	jtag_tclk_clr(p);
+	if (!p->cpu_halted)
+		return;
+
+	p->cpu_halted = false;
+	jtag_queue_tclk(p, 0);
 
 	/* clear the HALT_JTAG bit */
+	jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_queue_dr_shift_16(p, 0x2401, NULL);
+	jtag_queue_ir_shift(p, IR_ADDR_CAPTURE);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_flush(p);
+}
+
+/* Clocks a memory range through the PSA (Pseudo Signature Analysis)
+ * register of the target device and returns its value. The target computes
+ * the same signature as jtag_verify_psa() does on the probe, seeded with
+ * start_address-2.
+ * The target is not reset. The PC is loaded with the start address and left
+ * past the end of the range, so callers have to save and restore it, and
+ * the watchdog must not run (see jtag_wdt_hold()).
+ * start_address: start of data
+ * length       : number of words
+ * RETURN       : PSA value shifted out from the target device
+ */
+unsigned int jtag_psa_signature(struct jtdev *p,
+				address_t start_address,
+				unsigned int length)
+{
+	unsigned int psa_value;
+	unsigned int index;
+
+	jtag_release_cpu(p);
 	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x2401);
+	jtag_dr_write_16(p, 0x2401);
+	jtag_set_instruction_fetch(p);
+	jtag_ir_shift(p, IR_DATA_16BIT);
+	jtag_dr_write_16(p, 0x4030);
+	jtag_tclk_set(p);
+	jtag_tclk_clr(p);
+	jtag_dr_write_16(p, start_address-2);
+	jtag_tclk_set(p);
+	jtag_tclk_clr(p);
+	jtag_tclk_set(p);
+	jtag_tclk_clr(p);
+	jtag_tclk_set(p);
+	jtag_tclk_clr(p);
 	jtag_ir_shift(p, IR_ADDR_CAPTURE);
+	jtag_dr_write_16(p, 0x0000);
+	jtag_ir_shift(p, IR_DATA_PSA);
+
+	for (index = 0; index < length; index++) {
+		/* Clock through the PSA */
+		jtag_queue_tclk(p, 1);
+
+		/* Go through DR path without shifting data in/out */
+		jtag_queue_tms_sequence(p, 6, 0x19); /* TMS=1 0 0 1 1 0 ; 6 clocks */
+
+		jtag_queue_tclk(p, 0);
+	}
+
+	/* Read out the PSA value */
+	jtag_ir_shift(p, IR_SHIFT_OUT_PSA);
+	psa_value = jtag_dr_capture_16(p);
 	jtag_tclk_set(p);
+
+	return psa_value;
 }
 
-/* Compares the computed PSA (Pseudo Signature Analysis) value to the PSA
- * value shifted out from the target device. It is used for very fast data
- * block write or erasure verification.
+/* Compares the computed PSA value to the PSA value shifted out from the
+ * target device. It is used for very fast data block write or erasure
+ * verification. See jtag_psa_signature() for the state it leaves the
+ * target in.
  * start_address: start of data
  * length       : number of data
  * data         : pointer to data, 0 for erase check
@@ -382,7 +883,6 @@ static int jtag_verify_psa(struct jtdev *p,
 			   unsigned int length,
 			   const uint16_t *data)
 {
-	unsigned int psa_value;
 	unsigned int index;
 
 	/* Polynom value for PSA calculation */
@@ -390,25 +890,6 @@ static int jtag_verify_psa(struct jtdev *p,
 	/* Start value for PSA calculation */
 	unsigned int psa_crc = start_address-2;
 
-	jtag_execute_puc(p);
-	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x2401);
-	jtag_set_instruction_fetch(p);
-	jtag_ir_shift(p, IR_DATA_16BIT);
-	jtag_dr_shift_16(p, 0x4030);
-	jtag_tclk_set(p);
-	jtag_tclk_clr(p);
-	jtag_dr_shift_16(p, start_address-2);
-	jtag_tclk_set(p);
-	jtag_tclk_clr(p);
-	jtag_tclk_set(p);
-	jtag_tclk_clr(p);
-	jtag_tclk_set(p);
-	jtag_tclk_clr(p);
-	jtag_ir_shift(p, IR_ADDR_CAPTURE);
-	jtag_dr_shift_16(p, 0x0000);
-	jtag_ir_shift(p, IR_DATA_PSA);
-
 	for (index = 0; index < length; index++) {
 		/* Calculate the PSA value */
 		if ((psa_crc & 0x8000) == 0x8000) {
@@ -424,22 +905,73 @@ static int jtag_verify_psa(struct jtdev *p,
 		else
 			/* use data */
 			psa_crc ^= data[index];
+	}
 
-		/* Clock through the PSA */
-		jtag_tclk_set(p);
+	return (jtag_psa_signature(p, start_address, length) == (psa_crc & 0xFFFF)) ? 1 : 0;
+}
 
-		/* Go through DR path without shifting data in/out */
-		jtag_tms_sequence(p, 6, 0x19); /* TMS=1 0 0 1 1 0 ; 6 clocks */
+/* Checks whether JTAG works reliably at the current clock frequency:
+ * the IR capture must return the JTAG ID, data shifted through the
+ * bypass register must come back delayed by one bit, and a scratch RAM
+ * word must read back what was written to it.
+ * return: 1 - link is reliable
+ *         0 - otherwise
+ */
+static int jtag_link_check(struct jtdev *p)
+{
+	static const uint16_t patterns[] = { 0x5AA5, 0xA55A, 0xFFFF, 0x0000 };
+	unsigned int index;
 
-		jtag_tclk_clr(p);
+	for (index = 0; index < ARRAY_LEN(patterns); index++) {
+		/* The IR capture is part of the check, so don't skip it */
+		jtag_ir_invalidate(p);
+		if (jtag_ir_shift(p, IR_BYPASS) != p->jtag_id)
+			return 0;
+		if (jtag_dr_shift_16(p, patterns[index]) != (patterns[index] >> 1))
+			return 0;
 	}
 
-	/* Read out the PSA value */
-	jtag_ir_shift(p, IR_SHIFT_OUT_PSA);
-	psa_value = jtag_dr_shift_16(p, 0x0000);
-	jtag_tclk_set(p);
+	for (index = 0; index < ARRAY_LEN(patterns); index++) {
+		jtag_write_mem(p, 16, JTAG_TUNE_SCRATCH_ADDR, patterns[index]);
+		if (jtag_read_mem(p, 16, JTAG_TUNE_SCRATCH_ADDR) != patterns[index])
+			return 0;
+	}
+
+	return p->status == STATUS_OK;
+}
+
+/* Steps the JTAG clock up until the link check fails, then settles one step
+ * below the fastest frequency that passed. A failed step is followed by
+ * another link check at that frequency.
+ * return: 1 - the target is still under JTAG control
+ *         0 - the link check failed at the settled frequency as well
+ */
+static int jtag_tune_speed(struct jtdev *p)
+{
+	unsigned int passed = 0;
+	int ok = 1;
+
+	/* Errors are expected here, don't slow down on them */
+	p->tck_auto = false;
+
+	while (passed < ARRAY_LEN(jtag_tune_steps)) {
+		jtag_set_speed(p, jtag_tune_steps[passed]);
+		if (!jtag_link_check(p))
+			break;
+		passed++;
+	}
+
+	jtag_set_speed(p, jtag_tune_steps[passed >= 2 ? passed - 2 : 0]);
+	if (passed < ARRAY_LEN(jtag_tune_steps)) {
+		/* The failed step may have left the TAP out of step */
+		p->status = STATUS_OK;
+		p->tap_state = JTAG_TAP_UNKNOWN;
+		jtag_ir_invalidate(p);
+		ok = jtag_link_check(p);
+	}
+	p->tck_auto = true;
 
-	return (psa_value == psa_crc) ? 1 : 0;
+	return ok;
 }
 
 /* Take target device under JTAG control.
@@ -447,7 +979,7 @@ static int jtag_verify_psa(struct jtdev *p,
  * return: 0 - fuse is blown
  *        >0 - jtag id
  */
-unsigned int jtag_init(struct jtdev *p)
+static unsigned int jtag_attach(struct jtdev *p)
 {
 	unsigned int jtag_id;
 
@@ -475,21 +1007,54 @@ unsigned int jtag_init(struct jtdev *p)
 	return jtag_id;
 }
 
+/* Take target device under JTAG control, at the fastest reliable
+ * JTAG clock frequency if auto-tuning is enabled.
+ * return: 0 - fuse is blown
+ *        >0 - jtag id
+ */
+unsigned int jtag_init(struct jtdev *p)
+{
+	unsigned int jtag_id;
+	uint16_t scratch;
+
+	p->jtag_id = 0;
+	if (!p->tck_auto)
+		return jtag_attach(p);
+
+	jtag_set_speed(p, jtag_tune_steps[0]);
+	jtag_id = jtag_attach(p);
+	if (p->status != STATUS_OK)
+		return jtag_id;
+
+	scratch = jtag_read_mem(p, 16, JTAG_TUNE_SCRATCH_ADDR);
+	if (!jtag_tune_speed(p)) {
+		/* Start over at the frequency we settled on */
+		p->status = STATUS_OK;
+		jtag_id = jtag_attach(p);
+		if (p->status != STATUS_OK)
+			return jtag_id;
+	}
+	jtag_write_mem(p, 16, JTAG_TUNE_SCRATCH_ADDR, scratch);
+
+	return jtag_id;
+}
+
 unsigned int jtag_get_device(struct jtdev *p)
 {
 	unsigned int jtag_id = 0;
 	unsigned int loop_counter;
 
-	/* Set device into JTAG mode + read */
+	/* Set device into JTAG mode + read, this clears JTAG_HALT */
+	p->cpu_halted = false;
 	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x2401);
+	jtag_dr_write_16(p, 0x2401);
 
 	/* Wait until CPU is synchronized,
 	 * timeout after a limited number of attempts
 	 */
 	jtag_id = jtag_ir_shift(p, IR_CNTRL_SIG_CAPTURE);
 	for ( loop_counter = 50; loop_counter > 0; loop_counter--) {
-		if ( (jtag_dr_shift_16(p, 0x0000) & 0x0200) == 0x0200 ) {
+		if ( (jtag_dr_capture_16(p) & 0x0200) == 0x0200 ) {
 			break;
 		}
 	}
@@ -501,10 +1066,20 @@ unsigned int jtag_get_device(struct jtdev *p)
 	}
 
 	p->attached = true;
+	p->jtag_id = jtag_id;
 	jtag_led_green_on(p);
 	return jtag_id;
 }
 
+/* Set the JTAG clock frequency
+ * hz    : requested TCK frequency
+ * return: TCK frequency actually in effect
+ */
+unsigned long jtag_set_speed(struct jtdev *p, unsigned long hz)
+{
+	return jtag_sync(p)->f->jtdev_set_speed(p, hz);
+}
+
 /* Read the target chip id.
  * return: chip id
  */
@@ -533,26 +1108,26 @@ uint16_t jtag_read_mem(struct jtdev *p,
 	uint16_t content;
 
 	jtag_halt_cpu(p);
-	jtag_tclk_clr(p);
-	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_queue_tclk(p, 0);
+	jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
 	if (format == 16) {
 		/* set word read */
-		jtag_dr_shift_16(p, 0x2409);
+		jtag_queue_dr_shift_16(p, 0x2409, NULL);
 	} else {
 		/* set byte read */
-		jtag_dr_shift_16(p, 0x2419);
+		jtag_queue_dr_shift_16(p, 0x2419, NULL);
 	}
 	/* set address */
-	jtag_ir_shift(p, IR_ADDR_16BIT);
-	jtag_dr_shift_16(p, address);
-	jtag_ir_shift(p, IR_DATA_TO_ADDR);
-	jtag_tclk_set(p);
-	jtag_tclk_clr(p);
+	jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+	jtag_queue_dr_shift_16(p, address, NULL);
+	jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_tclk(p, 0);
 
 	/* shift out 16 bits */
-	content = jtag_dr_shift_16(p, 0x0000);
-	jtag_tclk_set(p); /* is also the first instruction in jtag_release_cpu() */
-	jtag_release_cpu(p);
+	jtag_queue_dr_shift_16(p, 0x0000, &content);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_flush(p);
 	if (format == 8)
 		content &= 0x00ff;
 
@@ -574,22 +1149,22 @@ void jtag_read_mem_quick(struct jtdev *p,
 	/* Initialize reading: */
 	jtag_write_reg(p, 0,address-4);
 	jtag_halt_cpu(p);
-	jtag_tclk_clr(p);
+	jtag_queue_tclk(p, 0);
 
 	/* set RW to read */
-	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x2409);
-	jtag_ir_shift(p, IR_DATA_QUICK);
+	jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_queue_dr_shift_16(p, 0x2409, NULL);
+	jtag_queue_ir_shift(p, IR_DATA_QUICK);
 
 	for (index = 0; index < length; index++) {
-		jtag_tclk_set(p);
-		jtag_tclk_clr(p);
+		jtag_queue_tclk(p, 1);
+		jtag_queue_tclk(p, 0);
 		/* shift out the data from the target */
-		data[index] = jtag_dr_shift_16(p, 0x0000);
+		jtag_queue_dr_shift_16(p, 0x0000, &data[index]);
 	}
 
-	jtag_tclk_set(p);
-	jtag_release_cpu(p);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_flush(p);
 }
 
 /* Writes one byte/word at a given address
@@ -603,26 +1178,26 @@ void jtag_write_mem(struct jtdev *p,
 		    uint16_t data)
 {
 	jtag_halt_cpu(p);
-	jtag_tclk_clr(p);
-	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_queue_tclk(p, 0);
+	jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
 
 	if (format == 16)
 		/* Set word write */
-		jtag_dr_shift_16(p, 0x2408);
+		jtag_queue_dr_shift_16(p, 0x2408, NULL);
 	else
 		/* Set byte write */
-		jtag_dr_shift_16(p, 0x2418);
+		jtag_queue_dr_shift_16(p, 0x2418, NULL);
 
-	jtag_ir_shift(p, IR_ADDR_16BIT);
+	jtag_queue_ir_shift(p, IR_ADDR_16BIT);
 
 	/* Set addr */
-	jtag_dr_shift_16(p, address);
-	jtag_ir_shift(p, IR_DATA_TO_ADDR);
+	jtag_queue_dr_shift_16(p, address, NULL);
+	jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
 
 	/* Shift in 16 bits */
-	jtag_dr_shift_16(p, data);
-	jtag_tclk_set(p);
-	jtag_release_cpu(p);
+	jtag_queue_dr_shift_16(p, data, NULL);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_flush(p);
 }
 
 /* Writes an array of words into target memory
@@ -639,25 +1214,25 @@ void jtag_write_mem_quick(struct jtdev *p,
 
 	/* Initialize writing */
 	jtag_write_reg(p, 0, address-4);
-	jtag_halt_cpu(p);
-	jtag_tclk_clr(p);
-	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_halt_cpu(p);
+	jtag_queue_tclk(p, 0);
+	jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
 
 	/* Set RW to write */
-	jtag_dr_shift_16(p, 0x2408);
-	jtag_ir_shift(p, IR_DATA_QUICK);
+	jtag_queue_dr_shift_16(p, 0x2408, NULL);
+	jtag_queue_ir_shift(p, IR_DATA_QUICK);
 
 	for (index = 0; index < length; index++) {
 		/* Write data */
-		jtag_dr_shift_16(p, data[index]);
+		jtag_queue_dr_shift_16(p, data[index], NULL);
 
 		/* Increment PC by 2 */
-		jtag_tclk_set(p);
-		jtag_tclk_clr(p);
+		jtag_queue_tclk(p, 1);
+		jtag_queue_tclk(p, 0);
 	}
 
-	jtag_tclk_set(p);
-	jtag_release_cpu(p);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_flush(p);
 }
 
 /* This function checks if the JTAG access security fuse is blown
@@ -687,11 +1262,12 @@ unsigned int jtag_execute_puc(struct jtdev *p)
 {
 	unsigned int jtag_id;
 
+	p->cpu_halted = false;
 	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
 
 	/* Apply and remove reset */
-	jtag_dr_shift_16(p, 0x2C01);
-	jtag_dr_shift_16(p, 0x2401);
+	jtag_dr_write_16(p, 0x2C01);
+	jtag_dr_write_16(p, 0x2401);
 	jtag_tclk_clr(p);
 	jtag_tclk_set(p);
 	jtag_tclk_clr(p);
@@ -703,11 +1279,31 @@ unsigned int jtag_execute_puc(struct jtdev *p)
 	jtag_id = jtag_ir_shift(p, IR_ADDR_CAPTURE);
 
 	/* Disable watchdog on target device */
-	jtag_write_mem(p, 16, 0x0120, 0x5A80);
+	jtag_write_mem(p, 16, WDTCTL, WDTPW | WDTHOLD);
 
 	return jtag_id;
 }
 
+/* Stops the watchdog of the target device without resetting it
+ * RETURN: previous value of WDTCTL, for jtag_wdt_restore()
+ */
+unsigned int jtag_wdt_hold(struct jtdev *p)
+{
+	unsigned int wdtctl = jtag_read_mem(p, 16, WDTCTL) & 0x00FF;
+
+	if (!(wdtctl & WDTHOLD))
+		jtag_write_mem(p, 16, WDTCTL, WDTPW | WDTHOLD | wdtctl);
+
+	return wdtctl;
+}
+
+/* Restores the watchdog state saved by jtag_wdt_hold() */
+void jtag_wdt_restore(struct jtdev *p, unsigned int wdtctl)
+{
+	if (!(wdtctl & WDTHOLD))
+		jtag_write_mem(p, 16, WDTCTL, WDTPW | wdtctl);
+}
+
 /* Release the target device from JTAG control
  * address: 0xFFFE - perform Reset,
  *                   load Reset Vector into PC
@@ -717,7 +1313,9 @@ unsigned int jtag_execute_puc(struct jtdev *p)
  */
 void jtag_release_device(struct jtdev *p, address_t address)
 {
+	jtag_release_cpu(p);
 	p->attached = false;
+	p->jtag_id = 0;
 	jtag_led_green_off(p);
 
 	switch (address) {
@@ -728,8 +1326,8 @@ void jtag_release_device(struct jtdev *p, address_t address)
 			jtag_set_breakpoint(p,-1,0);
 			/* issue reset */
 			jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-			jtag_dr_shift_16(p, 0x2C01);
-			jtag_dr_shift_16(p, 0x2401);
+			jtag_dr_write_16(p, 0x2C01);
+			jtag_dr_write_16(p, 0x2401);
 			break;
 		default: /* Set target CPU's PC */
 			jtag_write_reg(p, 0, address);
@@ -739,13 +1337,14 @@ void jtag_release_device(struct jtdev *p, address_t address)
 	jtag_set_instruction_fetch(p);
 
 	jtag_ir_shift(p, IR_EMEX_DATA_EXCHANGE);
-	jtag_dr_shift_16(p, BREAKREACT + READ);
-	jtag_dr_shift_16(p, 0x0000);
+	jtag_dr_write_16(p, BREAKREACT + READ);
+	jtag_dr_write_16(p, 0x0000);
 
 	jtag_ir_shift(p, IR_EMEX_WRITE_CONTROL);
-	jtag_dr_shift_16(p, 0x000f);
+	jtag_dr_write_16(p, 0x000f);
 
 	jtag_ir_shift(p, IR_CNTRL_SIG_RELEASE);
+	jtag_tap_goto(p, JTAG_TAP_IDLE, 0);
 }
 
 /* Performs a verification over the given memory range
@@ -771,6 +1370,67 @@ int jtag_erase_check(struct jtdev *p,
 	return jtag_verify_psa(p, start_address, length, NULL);
 }
 
+/* Reads FCTL3 while the flash controller is programming or erasing.
+ * Expects RW set to read and TCLK low, and leaves them that way.
+ * The TCLK cycle of the read also clocks the flash timing generator.
+ */
+static uint16_t jtag_flash_status(struct jtdev *p)
+{
+	uint16_t fctl3;
+
+	jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+	jtag_queue_dr_shift_16(p, FCTL3, NULL);
+	jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_tclk(p, 0);
+	jtag_queue_dr_shift_16(p, 0x0000, &fctl3);
+	jtag_queue_flush(p);
+
+	return fctl3;
+}
+
+/* Strobes TCLK until the bits of FCTL3 selected by mask read as value
+ * min_strobes: strobes issued before polling FCTL3 for the first time
+ * step       : strobes issued between polls
+ * max_strobes: strobes after which a controller still not there is an error
+ * RETURN     : number of TCLK cycles issued
+ */
+static unsigned int jtag_flash_poll(struct jtdev *p,
+				    unsigned int mask,
+				    unsigned int value,
+				    unsigned int min_strobes,
+				    unsigned int step,
+				    unsigned int max_strobes)
+{
+	unsigned int strobes = min_strobes;
+
+	jtag_tclk_strobe(p, min_strobes);
+	while (p->status == STATUS_OK) {
+		/* The read of FCTL3 takes one more TCLK cycle */
+		strobes++;
+		if ((jtag_flash_status(p) & mask) == value)
+			break;
+		if (strobes >= max_strobes) {
+			jtag_fail(p, STATUS_TIMED_OUT);
+			break;
+		}
+		jtag_tclk_strobe(p, step);
+		strobes += step;
+	}
+
+	return strobes;
+}
+
+/* Strobes TCLK until the flash controller is no longer busy */
+static unsigned int jtag_flash_wait(struct jtdev *p,
+				    unsigned int min_strobes,
+				    unsigned int step,
+				    unsigned int max_strobes)
+{
+	return jtag_flash_poll(p, FCTL3_BUSY, 0,
+			       min_strobes, step, max_strobes);
+}
+
 /* Programs/verifies data into a FLASH by using the
  * FLASH controller. The JTAG FLASH register isn't needed.
  * The input data is interpreted as an array of little-endian 16-bit words,
@@ -792,66 +1452,66 @@ void jtag_write_flash_le(struct jtdev *p,
 
 	address = start_address;
 	jtag_halt_cpu(p);
-	jtag_tclk_clr(p);
+	jtag_queue_tclk(p, 0);
 
 	/* Set RW to write */
-	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x2408);
+	jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_queue_dr_shift_16(p, 0x2408, NULL);
 
 	/* FCTL1 register */
-	jtag_ir_shift(p, IR_ADDR_16BIT);
-	jtag_dr_shift_16(p, 0x0128);
+	jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+	jtag_queue_dr_shift_16(p, 0x0128, NULL);
 
 	/* Enable FLASH write */
-	jtag_ir_shift(p, IR_DATA_TO_ADDR);
-	jtag_dr_shift_16(p, 0xA540);
-	jtag_tclk_set(p);
-	jtag_tclk_clr(p);
+	jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+	jtag_queue_dr_shift_16(p, 0xA540, NULL);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_tclk(p, 0);
 
 	/* FCTL2 register */
-	jtag_ir_shift(p, IR_ADDR_16BIT);
-	jtag_dr_shift_16(p, 0x012A);
+	jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+	jtag_queue_dr_shift_16(p, 0x012A, NULL);
 
 	/* Select MCLK as source, DIV=1 */
-	jtag_ir_shift(p, IR_DATA_TO_ADDR);
-	jtag_dr_shift_16(p, 0xA540);
-	jtag_tclk_set(p);
-	jtag_tclk_clr(p);
+	jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+	jtag_queue_dr_shift_16(p, 0xA540, NULL);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_tclk(p, 0);
 
 	/* FCTL3 register */
-	jtag_ir_shift(p, IR_ADDR_16BIT);
-	jtag_dr_shift_16(p, 0x012C);
+	jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+	jtag_queue_dr_shift_16(p, 0x012C, NULL);
 
 	/* Clear FCTL3 register */
-	jtag_ir_shift(p, IR_DATA_TO_ADDR);
-	jtag_dr_shift_16(p, 0xA500);
-	jtag_tclk_set(p);
-	jtag_tclk_clr(p);
+	jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+	jtag_queue_dr_shift_16(p, 0xA500, NULL);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_tclk(p, 0);
 
 	for (index = 0; index < length; index++) {
 		/* Set RW to write */
-		jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-		jtag_dr_shift_16(p, 0x2408);
+		jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+		jtag_queue_dr_shift_16(p, 0x2408, NULL);
 
 		/* Set address */
-		jtag_ir_shift(p, IR_ADDR_16BIT);
-		jtag_dr_shift_16(p, address);
+		jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+		jtag_queue_dr_shift_16(p, address, NULL);
 
 		/* Set data */
 		word = data[2*index+0] + (data[2*index+1] << 8);
-		jtag_ir_shift(p, IR_DATA_TO_ADDR);
-		jtag_dr_shift_16(p, word);
-		jtag_tclk_set(p);
-		jtag_tclk_clr(p);
+		jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+		jtag_queue_dr_shift_16(p, word, NULL);
+		jtag_queue_tclk(p, 1);
+		jtag_queue_tclk(p, 0);
 
 		/* Set RW to read */
-		jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-		jtag_dr_shift_16(p, 0x2409);
+		jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+		jtag_queue_dr_shift_16(p, 0x2409, NULL);
 
-		/* provide TCLKs
-		 * min. 33 for F149 and F449
-		 */
-		p->f->jtdev_tclk_strobe(p, 35);
+		/* provide TCLKs until the word is written */
+		jtag_flash_wait(p, FLASH_WORD_STROBES_MIN,
+				FLASH_WORD_STROBES_STEP,
+				FLASH_WORD_STROBES_MAX);
 		address += 2;
 
 		if (p->status != STATUS_OK)
@@ -859,18 +1519,133 @@ void jtag_write_flash_le(struct jtdev *p,
 	}
 
 	/* Set RW to write */
-	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x2408);
+	jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_queue_dr_shift_16(p, 0x2408, NULL);
 
 	/* FCTL1 register */
-	jtag_ir_shift(p, IR_ADDR_16BIT);
-	jtag_dr_shift_16(p, 0x0128);
+	jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+	jtag_queue_dr_shift_16(p, 0x0128, NULL);
 
 	/* Disable FLASH write */
-	jtag_ir_shift(p, IR_DATA_TO_ADDR);
-	jtag_dr_shift_16(p, 0xA500);
-	jtag_tclk_set(p);
-	jtag_release_cpu(p);
+	jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+	jtag_queue_dr_shift_16(p, 0xA500, NULL);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_flush(p);
+
+	jtag_led_red_off(p);
+}
+
+/* Writes a word to a flash controller register or to FLASH, leaving RW set
+ * to write and TCLK low */
+static void jtag_queue_flash_ctl(struct jtdev *p,
+				 unsigned int reg,
+				 unsigned int value)
+{
+	/* Set RW to write */
+	jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_queue_dr_shift_16(p, 0x2408, NULL);
+
+	jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+	jtag_queue_dr_shift_16(p, reg, NULL);
+
+	jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+	jtag_queue_dr_shift_16(p, value, NULL);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_tclk(p, 0);
+}
+
+/* Programs whole rows of FLASH with the flash controller in block write
+ * mode (BLKWRT), which needs fewer TCLKs per word than word writes. Falls
+ * back to jtag_write_flash_le() if TCK is too slow to finish a row in time.
+ * Each word waits for WAIT, and each row is checked for ACCVIFG, so that
+ * a word the controller didn't take is reported as a flash violation.
+ * start_address: start in FLASH, aligned to JTAG_FLASH_ROW_SIZE
+ * length       : number of words, a multiple of JTAG_FLASH_ROW_SIZE/2
+ * data         : pointer to data
+ */
+void jtag_write_flash_block_le(struct jtdev *p,
+			       address_t start_address,
+			       unsigned int length,
+			       const uint8_t *data)
+{
+	unsigned int index;
+	unsigned int address;
+	uint16_t word;
+
+	if (p->tck_hz < FLASH_BLOCK_MIN_TCK_HZ) {
+		jtag_write_flash_le(p, start_address, length, data);
+		return;
+	}
+
+	jtag_led_red_on(p);
+
+	address = start_address;
+	jtag_halt_cpu(p);
+	jtag_queue_tclk(p, 0);
+
+	/* Select MCLK as source, DIV=1 */
+	jtag_queue_flash_ctl(p, 0x012A, 0xA540);
+
+	/* Clear FCTL3 register */
+	jtag_queue_flash_ctl(p, 0x012C, 0xA500);
+
+	for (index = 0; index < length; index++) {
+		if (index % (JTAG_FLASH_ROW_SIZE/2) == 0) {
+			/* Enable FLASH block write */
+			jtag_queue_flash_ctl(p, 0x0128, 0xA5C0);
+		}
+
+		/* Set RW to write */
+		jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+		jtag_queue_dr_shift_16(p, 0x2408, NULL);
+
+		/* Set address */
+		jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+		jtag_queue_dr_shift_16(p, address, NULL);
+
+		/* Set data */
+		word = data[2*index+0] + (data[2*index+1] << 8);
+		jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+		jtag_queue_dr_shift_16(p, word, NULL);
+		jtag_queue_tclk(p, 1);
+		jtag_queue_tclk(p, 0);
+
+		/* Set RW to read */
+		jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+		jtag_queue_dr_shift_16(p, 0x2409, NULL);
+
+		/* provide TCLKs until WAIT is set again */
+		jtag_flash_poll(p, FCTL3_WAIT, FCTL3_WAIT,
+				index % (JTAG_FLASH_ROW_SIZE/2) == 0 ?
+				FLASH_BLOCK_FIRST_STROBES :
+				FLASH_BLOCK_NEXT_STROBES,
+				FLASH_WORD_STROBES_STEP,
+				FLASH_WORD_STROBES_MAX);
+		address += 2;
+
+		if (index % (JTAG_FLASH_ROW_SIZE/2) == JTAG_FLASH_ROW_SIZE/2 - 1 &&
+		    p->status == STATUS_OK) {
+			/* Leave block write, then wait for the end of the block */
+			jtag_queue_flash_ctl(p, 0x0128, 0xA500);
+			jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+			jtag_queue_dr_shift_16(p, 0x2409, NULL);
+			jtag_flash_wait(p, FLASH_BLOCK_END_STROBES,
+					FLASH_WORD_STROBES_STEP,
+					FLASH_WORD_STROBES_MAX);
+
+			if (p->status == STATUS_OK &&
+			    (jtag_flash_status(p) & FCTL3_ACCVIFG))
+				p->status = STATUS_FLASH_VIOLATION;
+		}
+
+		if (p->status != STATUS_OK)
+			break;
+	}
+
+	/* Disable FLASH write */
+	jtag_queue_flash_ctl(p, 0x0128, 0xA500);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_flush(p);
 
 	jtag_led_red_off(p);
 }
@@ -885,110 +1660,154 @@ void jtag_erase_flash(struct jtdev *p,
 		      unsigned int erase_mode,
 		      address_t erase_address)
 {
-	unsigned int number_of_strobes = 4820;	/* default for segment erase */
-	unsigned int loop_counter;
-	unsigned int max_loop_count = 1;	/* erase cycle repeating for mass erase */
+	unsigned long total_strobes = 0;	/* cumulative erase time */
+	unsigned long min_total_strobes = 0;	/* one erase cycle for segments */
 
 	jtag_led_red_on(p);
 
 	if ((erase_mode == JTAG_ERASE_MASS) ||
 	    (erase_mode == JTAG_ERASE_MAIN)) {
-		number_of_strobes = 5300;	/* Larger Flash memories require */
-		max_loop_count = 19;		/* additional cycles for erase. */
+		min_total_strobes = FLASH_MASS_ERASE_STROBES;
 		erase_address = 0xfffe;		/* overwrite given address */
 	}
 
-	for (loop_counter = max_loop_count; loop_counter > 0; loop_counter--) {
+	do {
 		jtag_halt_cpu(p);
-		jtag_tclk_clr(p);
+		jtag_queue_tclk(p, 0);
 
 		/* Set RW to write */
-		jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-		jtag_dr_shift_16(p, 0x2408);
+		jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+		jtag_queue_dr_shift_16(p, 0x2408, NULL);
 
 		/* FCTL1 address */
-		jtag_ir_shift(p, IR_ADDR_16BIT);
-		jtag_dr_shift_16(p, 0x0128);
+		jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+		jtag_queue_dr_shift_16(p, 0x0128, NULL);
 
 		/* Enable erase mode */
-		jtag_ir_shift(p, IR_DATA_TO_ADDR);
-		jtag_dr_shift_16(p, erase_mode);
-		jtag_tclk_set(p);
-		jtag_tclk_clr(p);
+		jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+		jtag_queue_dr_shift_16(p, erase_mode, NULL);
+		jtag_queue_tclk(p, 1);
+		jtag_queue_tclk(p, 0);
 
 		/* FCTL2 address */
-		jtag_ir_shift(p, IR_ADDR_16BIT);
-		jtag_dr_shift_16(p, 0x012A);
+		jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+		jtag_queue_dr_shift_16(p, 0x012A, NULL);
 
 		/* MCLK is source, DIV=1 */
-		jtag_ir_shift(p, IR_DATA_TO_ADDR);
-		jtag_dr_shift_16(p, 0xA540);
-		jtag_tclk_set(p);
-		jtag_tclk_clr(p);
+		jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+		jtag_queue_dr_shift_16(p, 0xA540, NULL);
+		jtag_queue_tclk(p, 1);
+		jtag_queue_tclk(p, 0);
 
 		/* FCTL3 address */
-		jtag_ir_shift(p, IR_ADDR_16BIT);
-		jtag_dr_shift_16(p, 0x012C);
+		jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+		jtag_queue_dr_shift_16(p, 0x012C, NULL);
 
 		/* Clear FCTL3 */
-		jtag_ir_shift(p, IR_DATA_TO_ADDR);
-		jtag_dr_shift_16(p, 0xA500);
-		jtag_tclk_set(p);
-		jtag_tclk_clr(p);
+		jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+		jtag_queue_dr_shift_16(p, 0xA500, NULL);
+		jtag_queue_tclk(p, 1);
+		jtag_queue_tclk(p, 0);
 
 		/* Set erase address */
-		jtag_ir_shift(p, IR_ADDR_16BIT);
-		jtag_dr_shift_16(p, erase_address);
+		jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+		jtag_queue_dr_shift_16(p, erase_address, NULL);
 
 		/* Dummy write to start erase */
-		jtag_ir_shift(p, IR_DATA_TO_ADDR);
-		jtag_dr_shift_16(p, 0x55AA);
-		jtag_tclk_set(p);
-		jtag_tclk_clr(p);
+		jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+		jtag_queue_dr_shift_16(p, 0x55AA, NULL);
+		jtag_queue_tclk(p, 1);
+		jtag_queue_tclk(p, 0);
 
 		/* Set RW to read */
-		jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-		jtag_dr_shift_16(p, 0x2409);
+		jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+		jtag_queue_dr_shift_16(p, 0x2409, NULL);
 
-		/* provide TCLKs */
-		p->f->jtdev_tclk_strobe(p, number_of_strobes);
+		/* provide TCLKs until the erase cycle is done */
+		total_strobes += jtag_flash_wait(p, FLASH_ERASE_STROBES_MIN,
+						 FLASH_ERASE_STROBES_STEP,
+						 FLASH_ERASE_STROBES_MAX);
 
 		/* Set RW to write */
-		jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-		jtag_dr_shift_16(p, 0x2408);
+		jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+		jtag_queue_dr_shift_16(p, 0x2408, NULL);
 
 		/* FCTL1 address */
-		jtag_ir_shift(p, IR_ADDR_16BIT);
-		jtag_dr_shift_16(p, 0x0128);
+		jtag_queue_ir_shift(p, IR_ADDR_16BIT);
+		jtag_queue_dr_shift_16(p, 0x0128, NULL);
 
 		/* Disable erase */
-		jtag_ir_shift(p, IR_DATA_TO_ADDR);
-		jtag_dr_shift_16(p, 0xA500);
-		jtag_tclk_set(p);
-		jtag_release_cpu(p);
-	}
+		jtag_queue_ir_shift(p, IR_DATA_TO_ADDR);
+		jtag_queue_dr_shift_16(p, 0xA500, NULL);
+		jtag_queue_tclk(p, 1);
+		jtag_queue_flush(p);
+	} while (p->status == STATUS_OK && total_strobes < min_total_strobes);
 
 	jtag_led_red_off(p);
 }
 
-/* Reads a register from the target CPU */
-address_t jtag_read_reg(struct jtdev *p, int reg)
+/* Erases a list of FLASH segments with a single flash controller setup
+ * addresses: an address within each segment
+ * count    : number of segments
+ */
+void jtag_erase_segments(struct jtdev *p,
+			 const address_t *addresses,
+			 unsigned int count)
 {
-	unsigned int value;
+	unsigned int index;
 
-	/* Set CPU into instruction fetch mode */
-	jtag_set_instruction_fetch(p);
+	jtag_led_red_on(p);
 
-	/* CPU controls RW & BYTE */
-	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x3401);
+	jtag_halt_cpu(p);
+	jtag_queue_tclk(p, 0);
+
+	/* MCLK is source, DIV=1 */
+	jtag_queue_flash_ctl(p, 0x012A, 0xA540);
+
+	/* Clear FCTL3 */
+	jtag_queue_flash_ctl(p, 0x012C, 0xA500);
+
+	for (index = 0; index < count; index++) {
+		/* Enable segment erase, cleared by the controller when done */
+		jtag_queue_flash_ctl(p, 0x0128, JTAG_ERASE_SGMT);
+
+		/* Dummy write to start erase */
+		jtag_queue_flash_ctl(p, addresses[index], 0x55AA);
+
+		/* Set RW to read */
+		jtag_queue_ir_shift(p, IR_CNTRL_SIG_16BIT);
+		jtag_queue_dr_shift_16(p, 0x2409, NULL);
+
+		/* provide TCLKs until the erase cycle is done */
+		jtag_flash_wait(p, FLASH_ERASE_STROBES_MIN,
+				FLASH_ERASE_STROBES_STEP,
+				FLASH_ERASE_STROBES_MAX);
+
+		if (p->status != STATUS_OK)
+			break;
+	}
+
+	/* Disable erase */
+	jtag_queue_flash_ctl(p, 0x0128, 0xA500);
+	jtag_queue_tclk(p, 1);
+	jtag_queue_flush(p);
 
+	jtag_led_red_off(p);
+}
+
+/* Injects the instructions that put a register on the data bus and reads it.
+ * The CPU must be in instruction fetch mode with the CPU controlling RW &
+ * BYTE. Returns with TCLK high in the last cycle of "mov Rn,&0x01fe", which
+ * the caller still has to clock.
+ */
+static unsigned int jtag_inject_read_reg(struct jtdev *p, int reg)
+{
 	jtag_ir_shift(p, IR_DATA_16BIT);
 
 	/* "jmp $-4" instruction */
 	/* PC - 4 -> PC          */
 	/* needs 2 clock cycles  */
-	jtag_dr_shift_16(p, 0x3ffd);
+	jtag_dr_write_16(p, 0x3ffd);
 	jtag_tclk_clr(p);
 	jtag_tclk_set(p);
 	jtag_tclk_clr(p);
@@ -1001,10 +1820,10 @@ address_t jtag_read_reg(struct jtdev *p, int reg)
 	 * it's a ROM address, write has no effect, but
 	 * the registers value is placed on the databus
 	 */
-	jtag_dr_shift_16(p, 0x4082 | (((unsigned int)reg << 8) & 0x0f00) );
+	jtag_dr_write_16(p, 0x4082 | (((unsigned int)reg << 8) & 0x0f00) );
 	jtag_tclk_clr(p);
 	jtag_tclk_set(p);
-	jtag_dr_shift_16(p, 0x01fe);
+	jtag_dr_write_16(p, 0x01fe);
 	jtag_tclk_clr(p);
 	jtag_tclk_set(p);
 	jtag_tclk_clr(p);
@@ -1018,13 +1837,60 @@ address_t jtag_read_reg(struct jtdev *p, int reg)
 
 	/* Read databus which contains the registers value */
 	jtag_ir_shift(p, IR_DATA_CAPTURE);
-	value = jtag_dr_shift_16(p, 0x0000);
+	return jtag_dr_capture_16(p);
+}
+
+/* Injects the instructions that load a register with a value.
+ * The CPU must be in instruction fetch mode with the CPU controlling RW &
+ * BYTE, and is back at an instruction fetch afterwards.
+ */
+static void jtag_inject_write_reg(struct jtdev *p, int reg, address_t value)
+{
+	jtag_ir_shift(p, IR_DATA_16BIT);
+
+	/* "jmp $-4" instruction */
+	/* PC - 4 -> PC          */
+	/* needs 4 clock cycles  */
+	jtag_dr_write_16(p, 0x3ffd);
+	jtag_tclk_clr(p);
+	jtag_tclk_set(p);
+	jtag_tclk_clr(p);
+	jtag_tclk_set(p);
+
+	/* "mov #value,Rn" instruction
+	 * value -> Rn
+	 * PC is advanced 4 bytes by this instruction
+	 * needs 2 clock cycles
+	 */
+	jtag_dr_write_16(p, 0x4030 | (reg & 0x000f) );
+	jtag_tclk_clr(p);
+	jtag_tclk_set(p);
+	jtag_dr_write_16(p, value);
+	jtag_tclk_clr(p);
+	jtag_tclk_set(p);
+}
+
+/* Reads a register from the target CPU */
+address_t jtag_read_reg(struct jtdev *p, int reg)
+{
+	unsigned int value;
+
+	jtag_release_cpu(p);
+
+	/* Set CPU into instruction fetch mode */
+	jtag_set_instruction_fetch(p);
+
+	/* CPU controls RW & BYTE */
+	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_dr_write_16(p, 0x3401);
+
+	value = jtag_inject_read_reg(p, reg);
 
 	jtag_tclk_clr(p);
 
 	/* JTAG controls RW & BYTE */
 	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x2401);
+	jtag_dr_write_16(p, 0x2401);
 
 	jtag_tclk_set(p);
 
@@ -1032,42 +1898,90 @@ address_t jtag_read_reg(struct jtdev *p, int reg)
 	return value;
 }
 
-/* Writes a value into a register of the target CPU */
-void jtag_write_reg(struct jtdev *p, int reg, address_t value)
+/* Reads all registers of the target CPU in a single instruction fetch
+ * session. "jmp $-4" and "mov Rn,&0x01fe" leave the PC where it was, so the
+ * instructions for all registers can be injected back-to-back.
+ */
+void jtag_read_regs(struct jtdev *p, address_t *regs)
 {
+	int reg;
+
+	jtag_release_cpu(p);
+
 	/* Set CPU into instruction fetch mode */
 	jtag_set_instruction_fetch(p);
 
 	/* CPU controls RW & BYTE */
 	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x3401);
+	jtag_dr_write_16(p, 0x3401);
 
-	jtag_ir_shift(p, IR_DATA_16BIT);
+	for (reg = 0; reg < JTAG_NUM_REGS; reg++) {
+		regs[reg] = jtag_inject_read_reg(p, reg);
 
-	/* "jmp $-4" instruction */
-	/* PC - 4 -> PC          */
-	/* needs 4 clock cycles  */
-	jtag_dr_shift_16(p, 0x3ffd);
-	jtag_tclk_clr(p);
-	jtag_tclk_set(p);
-	jtag_tclk_clr(p);
-	jtag_tclk_set(p);
+		if (reg == JTAG_NUM_REGS - 1)
+			break;
+
+		/* Finish "mov Rn,&0x01fe", fetch the next instruction */
+		jtag_tclk_clr(p);
+		jtag_tclk_set(p);
+	}
 
-	/* "mov #value,Rn" instruction
-	 * value -> Rn
-	 * PC is advanced 4 bytes by this instruction
-	 * needs 2 clock cycles
-	 */
-	jtag_dr_shift_16(p, 0x4030 | (reg & 0x000f) );
-	jtag_tclk_clr(p);
-	jtag_tclk_set(p);
-	jtag_dr_shift_16(p, value);
 	jtag_tclk_clr(p);
+
+	/* JTAG controls RW & BYTE */
+	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_dr_write_16(p, 0x2401);
+
 	jtag_tclk_set(p);
+}
+
+/* Writes a value into a register of the target CPU */
+void jtag_write_reg(struct jtdev *p, int reg, address_t value)
+{
+	jtag_release_cpu(p);
+
+	/* Set CPU into instruction fetch mode */
+	jtag_set_instruction_fetch(p);
+
+	/* CPU controls RW & BYTE */
+	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_dr_write_16(p, 0x3401);
+
+	jtag_inject_write_reg(p, reg, value);
+
+	/* JTAG controls RW & BYTE */
+	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_dr_write_16(p, 0x2401);
+}
+
+/* Writes all registers of the target CPU in a single instruction fetch
+ * session. The PC is written last, so that the "jmp $-4" of the other
+ * registers can't move it away from the new value. The SR goes right
+ * before it, so that an interrupt enabled by GIE can't be taken while the
+ * other registers are injected.
+ */
+void jtag_write_regs(struct jtdev *p, const address_t *regs)
+{
+	int reg;
+
+	jtag_release_cpu(p);
+
+	/* Set CPU into instruction fetch mode */
+	jtag_set_instruction_fetch(p);
+
+	/* CPU controls RW & BYTE */
+	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
+	jtag_dr_write_16(p, 0x3401);
+
+	jtag_inject_write_reg(p, 1, regs[1]);
+	for (reg = 3; reg < JTAG_NUM_REGS; reg++)
+		jtag_inject_write_reg(p, reg, regs[reg]);
+	jtag_inject_write_reg(p, 2, regs[2]);
+	jtag_inject_write_reg(p, 0, regs[0]);
 
 	/* JTAG controls RW & BYTE */
 	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x2401);
+	jtag_dr_write_16(p, 0x2401);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -1075,9 +1989,11 @@ void jtag_single_step( struct jtdev *p )
 {
 	unsigned int loop_counter;
 
+	jtag_release_cpu(p);
+
 	/* CPU controls RW & BYTE */
 	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x3401);
+	jtag_dr_write_16(p, 0x3401);
 
 	/* clock CPU until next instruction fetch cycle  */
 	/* failure after 10 clock cycles                 */
@@ -1086,14 +2002,14 @@ void jtag_single_step( struct jtdev *p )
 	for (loop_counter = 10; loop_counter > 0; loop_counter--) {
 		jtag_tclk_clr(p);
 		jtag_tclk_set(p);
-		if ((jtag_dr_shift_16(p, 0x0000) & 0x0080) == 0x0080) {
+		if ((jtag_dr_capture_16(p) & 0x0080) == 0x0080) {
 			break;
 		}
 	}
 
 	/* JTAG controls RW & BYTE */
 	jtag_ir_shift(p, IR_CNTRL_SIG_16BIT);
-	jtag_dr_shift_16(p, 0x2401);
+	jtag_dr_write_16(p, 0x2401);
 
 	if (loop_counter == 0) {
 		/* timeout reached */
@@ -1122,31 +2038,31 @@ unsigned int jtag_set_breakpoint( struct jtdev *p,int bp_num, address_t bp_addr
 		/* disable all breakpoints by deleting the BREAKREACT
 		 * register */
 		jtag_ir_shift(p, IR_EMEX_DATA_EXCHANGE);
-		jtag_dr_shift_16(p, BREAKREACT + WRITE);
-		jtag_dr_shift_16(p, 0x0000);
+		jtag_dr_write_16(p, BREAKREACT + WRITE);
+		jtag_dr_write_16(p, 0x0000);
 		return 1;
 	}
 
 	/* set breakpoint */
 	jtag_ir_shift(p, IR_EMEX_DATA_EXCHANGE);
-	jtag_dr_shift_16(p, GENCTRL + WRITE);
-	jtag_dr_shift_16(p, EEM_EN + CLEAR_STOP + EMU_CLK_EN + EMU_FEAT_EN);
+	jtag_dr_write_16(p, GENCTRL + WRITE);
+	jtag_dr_write_16(p, EEM_EN + CLEAR_STOP + EMU_CLK_EN + EMU_FEAT_EN);
 
 	jtag_ir_shift(p, IR_EMEX_DATA_EXCHANGE); //repeating may not needed
-	jtag_dr_shift_16(p, 8*bp_num + MBTRIGxVAL + WRITE);
-	jtag_dr_shift_16(p, bp_addr);
+	jtag_dr_write_16(p, 8*bp_num + MBTRIGxVAL + WRITE);
+	jtag_dr_write_16(p, bp_addr);
 
 	jtag_ir_shift(p, IR_EMEX_DATA_EXCHANGE); //repeating may not needed
-	jtag_dr_shift_16(p, 8*bp_num + MBTRIGxCTL + WRITE);
-	jtag_dr_shift_16(p, MAB + TRIG_0 + CMP_EQUAL);
+	jtag_dr_write_16(p, 8*bp_num + MBTRIGxCTL + WRITE);
+	jtag_dr_write_16(p, MAB + TRIG_0 + CMP_EQUAL);
 
 	jtag_ir_shift(p, IR_EMEX_DATA_EXCHANGE); //repeating may not needed
-	jtag_dr_shift_16(p, 8*bp_num + MBTRIGxMSK + WRITE);
-	jtag_dr_shift_16(p, NO_MASK);
+	jtag_dr_write_16(p, 8*bp_num + MBTRIGxMSK + WRITE);
+	jtag_dr_write_16(p, NO_MASK);
 
 	jtag_ir_shift(p, IR_EMEX_DATA_EXCHANGE); //repeating may not needed
-	jtag_dr_shift_16(p, 8*bp_num + MBTRIGxCMB + WRITE);
-	jtag_dr_shift_16(p, 1<<bp_num);
+	jtag_dr_write_16(p, 8*bp_num + MBTRIGxCMB + WRITE);
+	jtag_dr_write_16(p, 1<<bp_num);
 
 	/* read the actual setting of the BREAKREACT register         */
 	/* while reading a 1 is automatically shifted into LSB        */
@@ -1154,19 +2070,63 @@ unsigned int jtag_set_breakpoint( struct jtdev *p,int bp_num, address_t bp_addr
 	/* then the updated value is stored back                      */
 	jtag_ir_shift(p, IR_EMEX_DATA_EXCHANGE); //repeating may not needed
 	breakreact  = jtag_dr_shift_16(p, BREAKREACT + READ);
-	breakreact += jtag_dr_shift_16(p, 0x000);
+	breakreact += jtag_dr_capture_16(p);
 	breakreact  = (breakreact >> 1) | (1 << bp_num);
-	jtag_dr_shift_16(p, BREAKREACT + WRITE);
-	jtag_dr_shift_16(p, breakreact);
+	jtag_dr_write_16(p, BREAKREACT + WRITE);
+	jtag_dr_write_16(p, breakreact);
 	return 1;
 }
 
-/*----------------------------------------------------------------------------*/
+/* Reads an EEM register, the way jtag_set_breakpoint() reads BREAKREACT */
+static unsigned int jtag_eem_read(struct jtdev *p, unsigned int reg)
+{
+	unsigned int value;
+
+	jtag_ir_shift(p, IR_EMEX_DATA_EXCHANGE);
+	value  = jtag_dr_shift_16(p, reg + READ);
+	value += jtag_dr_capture_16(p);
+	return (value >> 1) & 0xFFFF;
+}
+
+static void jtag_eem_write(struct jtdev *p, unsigned int reg,
+			   unsigned int value)
+{
+	jtag_ir_shift(p, IR_EMEX_DATA_EXCHANGE);
+	jtag_dr_write_16(p, reg + WRITE);
+	jtag_dr_write_16(p, value);
+}
+
+void jtag_save_breakpoint(struct jtdev *p, int bp_num,
+			  struct jtag_breakpoint *bp)
+{
+	bp->val = jtag_eem_read(p, 8*bp_num + MBTRIGxVAL);
+	bp->ctl = jtag_eem_read(p, 8*bp_num + MBTRIGxCTL);
+	bp->msk = jtag_eem_read(p, 8*bp_num + MBTRIGxMSK);
+	bp->cmb = jtag_eem_read(p, 8*bp_num + MBTRIGxCMB);
+	bp->enabled = (jtag_eem_read(p, BREAKREACT) >> bp_num) & 1;
+}
+
+void jtag_restore_breakpoint(struct jtdev *p, int bp_num,
+			     const struct jtag_breakpoint *bp)
+{
+	unsigned int breakreact;
+
+	jtag_eem_write(p, 8*bp_num + MBTRIGxVAL, bp->val);
+	jtag_eem_write(p, 8*bp_num + MBTRIGxCTL, bp->ctl);
+	jtag_eem_write(p, 8*bp_num + MBTRIGxMSK, bp->msk);
+	jtag_eem_write(p, 8*bp_num + MBTRIGxCMB, bp->cmb);
+
+	breakreact = jtag_eem_read(p, BREAKREACT) & ~(1 << bp_num);
+	if (bp->enabled)
+		breakreact |= 1 << bp_num;
+	jtag_eem_write(p, BREAKREACT, breakreact);
+}
+
 unsigned int jtag_cpu_state( struct jtdev *p )
 {
 	jtag_ir_shift(p, IR_EMEX_READ_CONTROL);
 
-	if ((jtag_dr_shift_16(p, 0x0000) & 0x0080) == 0x0080) {
+	if ((jtag_dr_capture_16(p) & 0x0080) == 0x0080) {
 		return 1; /* halted */
 	} else {
 		return 0; /* running */
@@ -40,17 +40,37 @@
 
 /* Declared in jtdev.h */
 struct jtdev;
+struct jtag_op;
 
 /* Flash erasing modes */
 #define JTAG_ERASE_MASS 0xA506
 #define JTAG_ERASE_MAIN 0xA504
 #define JTAG_ERASE_SGMT 0xA502
 
+/* Size of a flash row programmed by jtag_write_flash_block_le() */
+#define JTAG_FLASH_ROW_SIZE 64
+
+/* Number of CPU registers, R0 (PC) to R15 */
+#define JTAG_NUM_REGS 16
+
+/* EEM trigger of a breakpoint, as saved by jtag_save_breakpoint() */
+struct jtag_breakpoint {
+	uint16_t val;
+	uint16_t ctl;
+	uint16_t msk;
+	uint16_t cmb;
+	int enabled;
+};
+
 /* Take target device under JTAG control. */
 unsigned int jtag_init(struct jtdev *p);
 
 unsigned int jtag_get_device(struct jtdev *p);
 
+/* Set the JTAG clock frequency, returns the frequency actually in effect.
+ * With auto-tuning enabled in the jtdev, jtag_init() picks the frequency. */
+unsigned long jtag_set_speed(struct jtdev *p, unsigned long hz);
+
 /* Read the target chip id. */
 unsigned int jtag_chip_id(struct jtdev *p);
 
@@ -86,7 +106,17 @@ unsigned int jtag_execute_puc(struct jtdev *p);
 /* Release the target device from JTAG control */
 void jtag_release_device(struct jtdev *p, address_t address);
 
-/* Performs a verification over the given memory range */
+/* Stops the watchdog without a PUC, and restores its previous state */
+unsigned int jtag_wdt_hold(struct jtdev *p);
+void jtag_wdt_restore(struct jtdev *p, unsigned int wdtctl);
+
+/* Returns the PSA signature the target computes over a range of words */
+unsigned int jtag_psa_signature(struct jtdev *p,
+				address_t start_address,
+				unsigned int word_count);
+
+/* Performs a verification over the given memory range. Neither this nor
+ * jtag_erase_check() reset the target, but both change the PC. */
 int jtag_verify_mem(struct jtdev *p,
 		    address_t start_address,
 		    unsigned int word_count,
@@ -103,29 +133,63 @@ void jtag_write_flash_le(struct jtdev *p,
 		      unsigned int word_count,
 		      const uint8_t *data);
 
+/* Programs whole rows of FLASH in block write mode */
+void jtag_write_flash_block_le(struct jtdev *p,
+			       address_t start_address,
+			       unsigned int word_count,
+			       const uint8_t *data);
+
 /* Performs a mass erase or a segment erase of a FLASH module */
 void jtag_erase_flash(struct jtdev *p,
 		      unsigned int erase_mode,
 		      address_t erase_address);
 
+/* Erases a list of FLASH segments with a single flash controller setup */
+void jtag_erase_segments(struct jtdev *p,
+			 const address_t *addresses,
+			 unsigned int count);
+
 /* Reads a register from the target CPU */
 address_t jtag_read_reg(struct jtdev *p, int reg);
 
 /* Writes a value into a register of the target CPU */
 void jtag_write_reg(struct jtdev *p, int reg, address_t value);
+
+/* Reads/writes all JTAG_NUM_REGS registers of the target CPU at once */
+void jtag_read_regs(struct jtdev *p, address_t *regs);
+void jtag_write_regs(struct jtdev *p, const address_t *regs);
 void jtag_single_step(struct jtdev *p);
 unsigned int jtag_set_breakpoint(struct jtdev *p,
 				 int bp_num, address_t bp_addr);
+/* Save and restore a breakpoint, so that it can be borrowed and given back */
+void jtag_save_breakpoint(struct jtdev *p, int bp_num,
+			  struct jtag_breakpoint *bp);
+void jtag_restore_breakpoint(struct jtdev *p, int bp_num,
+			     const struct jtag_breakpoint *bp);
 unsigned int jtag_cpu_state(struct jtdev *p);
 int jtag_get_config_fuses(struct jtdev *p);
 
+/* Transaction queue: operations are collected and run in one burst by
+ * jtag_queue_flush(), which also happens automatically when the queue is
+ * full or before any other JTAG access. Results of queued DR scans are only
+ * valid after the queue has been flushed. */
+void jtag_queue_ir_shift(struct jtdev *p, uint8_t ir);
+void jtag_queue_dr_shift_16(struct jtdev *p, uint16_t dr, uint16_t *result);
+void jtag_queue_tclk(struct jtdev *p, int out);
+void jtag_queue_tms_sequence(struct jtdev *p, int bits, unsigned int value);
+void jtag_queue_flush(struct jtdev *p);
+
 /* Default low-level JTAG routines for jtdev implementations that don't have
  * their own implementations of these routines */
 uint8_t jtag_default_ir_shift(struct jtdev *p, uint8_t ir);
 uint8_t jtag_default_dr_shift_8(struct jtdev *p, uint8_t dr);
 uint16_t jtag_default_dr_shift_16(struct jtdev *p, uint16_t dr);
+void jtag_default_dr_write_16(struct jtdev *p, uint16_t dr);
+uint16_t jtag_default_dr_capture_16(struct jtdev *p);
 void jtag_default_tms_sequence(struct jtdev *p, int bits, unsigned int value);
 void jtag_default_init_dap(struct jtdev *p);
+void jtag_default_run_queue(struct jtdev *p, const struct jtag_op *ops,
+			    unsigned int count);
 
 #if 0
 int jtag_refresh_bps(const char *driver, device_t dev, struct jtdev *p);
@@ -23,11 +23,80 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* Operations that can be put into the JTAG transaction queue */
+#define JTAG_OP_IR_SHIFT	0
+#define JTAG_OP_DR_SHIFT	1
+#define JTAG_OP_TCLK		2
+#define JTAG_OP_TMS_SEQUENCE	3
+
+#define JTDEV_QUEUE_CAPACITY	64
+
+/* TAP controller states, as tracked by jtaglib */
+#define JTAG_TAP_RESET		0	/* Test-Logic-Reset */
+#define JTAG_TAP_IDLE		1	/* Run-Test/Idle */
+#define JTAG_TAP_SELECT_DR	2
+#define JTAG_TAP_CAPTURE_DR	3
+#define JTAG_TAP_SHIFT_DR	4
+#define JTAG_TAP_EXIT1_DR	5
+#define JTAG_TAP_PAUSE_DR	6
+#define JTAG_TAP_EXIT2_DR	7
+#define JTAG_TAP_UPDATE_DR	8
+#define JTAG_TAP_SELECT_IR	9
+#define JTAG_TAP_CAPTURE_IR	10
+#define JTAG_TAP_SHIFT_IR	11
+#define JTAG_TAP_EXIT1_IR	12
+#define JTAG_TAP_PAUSE_IR	13
+#define JTAG_TAP_EXIT2_IR	14
+#define JTAG_TAP_UPDATE_IR	15
+#define JTAG_TAP_UNKNOWN	16
+#define JTAG_TAP_NUM_STATES	16
+
+/* Frequency range of the flash timing generator, which is clocked by
+ * jtdev_tclk_strobe() during flash programming and erasure
+ */
+#define JTDEV_TCLK_STROBE_MIN_HZ	257000
+#define JTDEV_TCLK_STROBE_MAX_HZ	476000
+
+/* JTAG pins in the shadow pin state of struct jtdev */
+#define JTDEV_PIN_TCK		0x01
+#define JTDEV_PIN_TMS		0x02
+#define JTDEV_PIN_TDI		0x04
+#define JTDEV_PIN_RST		0x08
+#define JTDEV_PIN_TST		0x10
+
+struct jtag_op {
+	uint8_t type;
+	uint8_t bits;		/* scan length or TMS sequence length */
+	uint16_t value;		/* data shifted in, TCLK level or TMS sequence */
+	uint16_t *result;	/* where to store the scanned TDO value, or NULL */
+};
+
 struct jtdev_func;
 struct jtdev {
 	const struct jtdev_func *f;
 	int status;
 	bool attached;
+	/* CPU is held in the controlled stop state between accesses */
+	bool cpu_halted;
+
+	/* TCK frequency in effect, as set by jtdev_set_speed() */
+	unsigned long tck_hz;
+	/* Tune TCK when attaching, and slow down on link errors */
+	bool tck_auto;
+	/* IR capture value of the attached device, 0 if unknown */
+	unsigned int jtag_id;
+	/* Instruction last loaded into the IR, -1 if unknown */
+	int ir_cache;
+	/* TAP controller state after everything issued so far, including
+	 * queued operations, as a JTAG_TAP_* value */
+	uint8_t tap_state;
+	/* Frequency of the strobes generated by jtdev_tclk_strobe() */
+	unsigned long tclk_strobe_hz;
+
+	unsigned int queue_count;
+	struct jtag_op queue[JTDEV_QUEUE_CAPACITY];
+	/* Values captured by queued IR scans, indexed like the queue */
+	uint16_t queue_ir_capture[JTDEV_QUEUE_CAPACITY];
 
 	int pin_tck;
 	int pin_tms;
@@ -35,6 +104,12 @@ struct jtdev {
 	int pin_tdo;
 	int pin_rst;
 	int pin_tst;
+
+	/* Last level driven onto each pin, and which pins are outputs,
+	 * as JTDEV_PIN_* bits. Lets the backend skip redundant writes.
+	 */
+	uint8_t pin_level;
+	uint8_t pin_output;
 };
 
 struct jtdev_func {
@@ -61,6 +136,13 @@ struct jtdev_func {
 	void (*jtdev_tst)(struct jtdev *p, int out);
 	int (*jtdev_tdo_get)(struct jtdev *p);
 
+/* Set the TCK (and TCLK) frequency as close to hz as the interface allows
+ * without exceeding it. Returns the frequency actually in effect. Flash
+ * timing generated by jtdev_tclk_strobe() must not depend on this setting,
+ * it follows the tclk_strobe_hz field instead.
+ */
+	unsigned long (*jtdev_set_speed)(struct jtdev *p, unsigned long hz);
+
 /* TCLK management */
 	void (*jtdev_tclk)(struct jtdev *p, int out);
 	int (*jtdev_tclk_get)(struct jtdev *p);
@@ -70,12 +152,27 @@ struct jtdev_func {
 	void (*jtdev_led_green)(struct jtdev *p, int out);
 	void (*jtdev_led_red)(struct jtdev *p, int out);
 
-/* Optional functions implementing higher-level stuff */
+/* Optional functions implementing higher-level stuff.
+ *
+ * IR and DR scans start in Run-Test/Idle or in Update-DR/IR, which both go
+ * to Select-DR-Scan on TMS high, and end in Update-IR/DR. TCLK edges and
+ * strobes are only issued in Run-Test/Idle. jtaglib moves the TAP there
+ * with jtdev_tms_sequence() when needed.
+ */
 	uint8_t (*jtdev_ir_shift)(struct jtdev *p, uint8_t ir);
 	uint8_t (*jtdev_dr_shift_8)(struct jtdev *p, uint8_t dr);
 	uint16_t (*jtdev_dr_shift_16)(struct jtdev *p, uint16_t dr);
+/* Variants of jtdev_dr_shift_16() that don't sample TDO, or that shift in
+ * zeros for scans which only read the data register */
+	void (*jtdev_dr_write_16)(struct jtdev *p, uint16_t dr);
+	uint16_t (*jtdev_dr_capture_16)(struct jtdev *p);
 	void (*jtdev_tms_sequence)(struct jtdev *p, int bits, unsigned int value);
 	void (*jtdev_init_dap)(struct jtdev *p);
+
+/* Run a sequence of queued operations. Scans are only read back when the
+ * operation has a result pointer. */
+	void (*jtdev_run_queue)(struct jtdev *p, const struct jtag_op *ops,
+				unsigned int count);
 };
 
 #endif
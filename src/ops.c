@@ -1,6 +1,92 @@
+#include <string.h>
+
 #include "picofet_proto.h"
 #include "jtdev.h"
 #include "jtaglib.h"
+#include "cmd.h"
+#include "pico_dev.h"
+
+// Quick access streams words through the instruction fetch of the CPU, with
+// the PC pointing at the data. That's only safe in RAM and flash, where a
+// read has no side effects, so peripheral space below QUICK_ACCESS_START
+// always uses regular accesses. The PC has to be saved and restored around
+// the transfer, so short transfers are faster without it.
+#define QUICK_ACCESS_START 0x0200
+#define QUICK_ACCESS_END   0x10000
+#define QUICK_MIN_WORDS    8
+#define QUICK_CHUNK_WORDS  128
+
+// Ranges are verified in chunks of one flash segment, so a mismatch can be
+// narrowed down to the first chunk that differs.
+#define VERIFY_CHUNK_WORDS 256
+
+// Bytes read per step of the probe-side CRC
+#define CRC_CHUNK_BYTES 256
+
+static bool quick_access_ok(address_t address, address_t num_words) {
+	return num_words >= QUICK_MIN_WORDS
+	    && address >= QUICK_ACCESS_START
+	    && address + 2 * num_words <= QUICK_ACCESS_END;
+}
+
+static void read_words_quick(struct jtdev *p, address_t address, address_t num_words, uint8_t *buffer) {
+	uint16_t words[QUICK_CHUNK_WORDS];
+
+	address_t pc = jtag_read_reg(p, 0);
+	if (p->status != STATUS_OK) {
+		return;
+	}
+
+	while (num_words) {
+		unsigned count = num_words < QUICK_CHUNK_WORDS ? num_words : QUICK_CHUNK_WORDS;
+		jtag_read_mem_quick(p, address, count, words);
+		if (p->status != STATUS_OK) {
+			return;
+		}
+		for (unsigned i = 0; i < count; i++) {
+			buffer[2*i+0] = words[i] & 0xff;
+			buffer[2*i+1] = (words[i] >> 8) & 0xff;
+		}
+		address   += 2 * count;
+		buffer    += 2 * count;
+		num_words -= count;
+	}
+
+	jtag_write_reg(p, 0, pc);
+}
+
+// Quick write without saving the PC, for callers that restore it themselves
+static void write_words_quick_raw(struct jtdev *p, address_t address, address_t num_words, const uint8_t *buffer) {
+	uint16_t words[QUICK_CHUNK_WORDS];
+
+	while (num_words) {
+		unsigned count = num_words < QUICK_CHUNK_WORDS ? num_words : QUICK_CHUNK_WORDS;
+		for (unsigned i = 0; i < count; i++) {
+			words[i] = buffer[2*i+0] | (buffer[2*i+1] << 8);
+		}
+		jtag_write_mem_quick(p, address, count, words);
+		if (p->status != STATUS_OK) {
+			return;
+		}
+		address   += 2 * count;
+		buffer    += 2 * count;
+		num_words -= count;
+	}
+}
+
+static void write_words_quick(struct jtdev *p, address_t address, address_t num_words, const uint8_t *buffer) {
+	address_t pc = jtag_read_reg(p, 0);
+	if (p->status != STATUS_OK) {
+		return;
+	}
+
+	write_words_quick_raw(p, address, num_words, buffer);
+	if (p->status != STATUS_OK) {
+		return;
+	}
+
+	jtag_write_reg(p, 0, pc);
+}
 
 void read_memory(struct jtdev *p, address_t address, address_t length, uint8_t *buffer) {
 	address_t cursor = 0;
@@ -16,6 +102,15 @@ void read_memory(struct jtdev *p, address_t address, address_t length, uint8_t *
 		cursor += 1;
 	}
 
+	address_t num_words = (length - cursor) / 2;
+	if (quick_access_ok(address + cursor, num_words)) {
+		read_words_quick(p, address + cursor, num_words, buffer + cursor);
+		if (p->status != STATUS_OK) {
+			return;
+		}
+		cursor += 2 * num_words;
+	}
+
 	while ((length - cursor) >= 2) {
 		word = jtag_read_mem(p, 16, address + cursor);
 		if (p->status != STATUS_OK) {
@@ -49,6 +144,15 @@ void write_ram(struct jtdev *p, address_t address, address_t length, const uint8
 		cursor += 1;
 	}
 
+	address_t num_words = (length - cursor) / 2;
+	if (quick_access_ok(address + cursor, num_words)) {
+		write_words_quick(p, address + cursor, num_words, buffer + cursor);
+		if (p->status != STATUS_OK) {
+			return;
+		}
+		cursor += 2 * num_words;
+	}
+
 	while ((length - cursor) >= 2) {
 		word = buffer[cursor+0] | (buffer[cursor+1] << 8);
 		jtag_write_mem(p, 16, address + cursor, word);
@@ -67,33 +171,600 @@ void write_ram(struct jtdev *p, address_t address, address_t length, const uint8
 	}
 }
 
+// Flash loader, run by the target from RAM at loader.ram_start. It programs
+// R14 words from R12 (RAM) to R13 (flash) in block write mode, with FCTL2
+// set to R15, and returns ACCVIFG in R15. It needs no stack and no fixed
+// addresses, and stops on EEM breakpoint RUN_BREAKPOINT at its end.
+static const uint16_t loader_code[] = {
+	0xC232,                 //       dint
+	0x4303,                 //       nop
+	0x4F82, 0x012A,         //       mov   r15, &FCTL2
+	0x40B2, 0xA500, 0x012C, //       mov   #FWKEY, &FCTL3
+	0x40B2, 0xA5C0, 0x0128, // row:  mov   #FWKEY|BLKWRT|WRT, &FCTL1
+	0x4CBD, 0x0000,         // word: mov   @r12+, 0(r13)
+	0x532D,                 //       incd  r13
+	0xB2B2, 0x012C,         // wait: bit   #WAIT, &FCTL3
+	0x27FD,                 //       jz    wait
+	0x831E,                 //       dec   r14
+	0x2403,                 //       jz    end
+	0xB03D, 0x003F,         //       bit   #63, r13
+	0x23F5,                 //       jnz   word
+	0x40B2, 0xA500, 0x0128, // end:  mov   #FWKEY, &FCTL1
+	0xB392, 0x012C,         // busy: bit   #BUSY, &FCTL3
+	0x23FD,                 //       jnz   busy
+	0x930E,                 //       tst   r14
+	0x23EA,                 //       jnz   row
+	0x421F, 0x012C,         //       mov   &FCTL3, r15
+	0xF22F,                 //       and   #ACCVIFG, r15
+	0x40B2, 0xA510, 0x012C, //       mov   #FWKEY|LOCK, &FCTL3
+	0x3FFF,                 // done: jmp   done
+};
+
+#define LOADER_SIZE        (ARRAY_LEN(loader_code) * 2)
+#define LOADER_DONE_OFFSET (LOADER_SIZE - 2)
+
+// Time the loader may take per word before it's considered hung: a block
+// write word takes at most 18 cycles of a 257 kHz flash timing generator,
+// plus the polling loop. Every chunk also gets LOADER_TIMEOUT_US.
+#define LOADER_TIMEOUT_US      100000
+#define LOADER_WORD_TIMEOUT_US 200
+
+// Target RAM given to the flash loader with set_flash_loader(), size 0 if
+// flash is programmed over JTAG
+static struct {
+	address_t ram_start;
+	address_t ram_size;
+	uint16_t  fctl2;
+} loader;
+
+int set_flash_loader(address_t ram_start, address_t ram_size, uint16_t fctl2) {
+	if (ram_size == 0) {
+		loader.ram_size = 0;
+		return 0;
+	}
+	if ((ram_start & 1) || ram_start < QUICK_ACCESS_START
+	    || ram_size < LOADER_SIZE + JTAG_FLASH_ROW_SIZE
+	    || ram_start + ram_size > QUICK_ACCESS_END) {
+		return -1;
+	}
+	loader.ram_start = ram_start;
+	loader.ram_size  = ram_size & ~1u;
+	loader.fctl2     = fctl2;
+	return 0;
+}
+
+// EEM breakpoint the target stops on when it runs code for us. A breakpoint
+// the host set there is saved with the run context and given back after.
+#define RUN_BREAKPOINT 0
+
+// Target state around code run for us: the registers, the watchdog, the
+// borrowed breakpoint and, if ram_len isn't 0, RAM the code overwrote.
+struct run_context {
+	address_t regs[JTAG_NUM_REGS];
+	unsigned int wdtctl;
+	struct jtag_breakpoint bp;
+	address_t ram_start;
+	address_t ram_len;
+	const uint8_t *ram;
+};
+
+static void run_save(struct jtdev *p, struct run_context *ctx) {
+	jtag_read_regs(p, ctx->regs);
+	ctx->wdtctl = jtag_wdt_hold(p);
+	jtag_save_breakpoint(p, RUN_BREAKPOINT, &ctx->bp);
+	ctx->ram_len = 0;
+}
+
+// Leave the target as it was even after an error, but report the first one.
+static void run_restore(struct jtdev *p, const struct run_context *ctx) {
+	int status = p->status;
+
+	// write_ram() starts over with a clean status, so it goes first
+	p->status = STATUS_OK;
+	if (ctx->ram_len) {
+		write_ram(p, ctx->ram_start, ctx->ram_len, ctx->ram);
+	}
+	jtag_restore_breakpoint(p, RUN_BREAKPOINT, &ctx->bp);
+	jtag_write_regs(p, ctx->regs);
+	jtag_wdt_restore(p, ctx->wdtctl);
+	if (status != STATUS_OK) {
+		p->status = status;
+	}
+}
+
+// Run the target from regs[0] until it stops on an EEM breakpoint set by the
+// caller, then take control again and read back its registers. Returns false
+// if the target didn't get there within timeout_us. USB and the watchdog
+// are serviced while waiting, as runs may take seconds.
+static bool run_to_breakpoint(struct jtdev *p, address_t *regs, unsigned long timeout_us) {
+	jtag_write_regs(p, regs);
+	jtag_release_device(p, 0xffff);
+
+	unsigned long start = cmd_time_us();
+	bool stopped;
+	while (!(stopped = jtag_cpu_state(p))) {
+		if (cmd_time_us() - start > timeout_us) {
+			break;
+		}
+		pico_dev_idle();
+	}
+
+	jtag_get_device(p);
+	if (p->status != STATUS_OK) {
+		return false;
+	}
+	jtag_read_regs(p, regs);
+	return stopped;
+}
+
+// Program flash through the loader: the loader goes to the start of its RAM,
+// the data it programs right after it. JTAG can't access memory while the
+// CPU runs, so chunks are uploaded while the target waits at its breakpoint,
+// and each chunk is as large as the RAM allows.
+static void write_flash_loader(struct jtdev *p, address_t address, address_t num_words, const uint8_t *buffer) {
+	struct run_context ctx;
+	address_t regs[JTAG_NUM_REGS];
+	address_t buffer_start = loader.ram_start + LOADER_SIZE;
+	address_t chunk_words  = (loader.ram_size - LOADER_SIZE) / 2;
+
+	run_save(p, &ctx);
+	if (p->status != STATUS_OK) {
+		return;
+	}
+	jtag_write_mem_quick(p, loader.ram_start, ARRAY_LEN(loader_code), loader_code);
+	jtag_set_breakpoint(p, RUN_BREAKPOINT, loader.ram_start + LOADER_DONE_OFFSET);
+
+	while (num_words && p->status == STATUS_OK) {
+		address_t count = num_words < chunk_words ? num_words : chunk_words;
+		write_words_quick_raw(p, buffer_start, count, buffer);
+		if (p->status != STATUS_OK) {
+			break;
+		}
+
+		memcpy(regs, ctx.regs, sizeof regs);
+		regs[0]  = loader.ram_start;
+		regs[2]  = 0; // SR: clear CPUOFF and the other low-power bits
+		regs[12] = buffer_start;
+		regs[13] = address;
+		regs[14] = count;
+		regs[15] = loader.fctl2;
+		unsigned long timeout = LOADER_TIMEOUT_US + count * LOADER_WORD_TIMEOUT_US;
+		if (!run_to_breakpoint(p, regs, timeout) && p->status == STATUS_OK) {
+			p->status = STATUS_TIMED_OUT;
+		}
+		if (p->status != STATUS_OK) {
+			break;
+		}
+		if (regs[15] != 0) {
+			p->status = STATUS_FLASH_VIOLATION;
+			break;
+		}
+
+		address   += 2 * count;
+		buffer    += 2 * count;
+		num_words -= count;
+	}
+
+	run_restore(p, &ctx);
+}
+
+// Program one byte of flash, leaving the other byte of its word as it is.
+static void write_flash_byte(struct jtdev *p, address_t address, uint8_t byte) {
+	uint8_t word[2] = { 0xff, 0xff };
+
+	word[address & 1] = byte;
+	jtag_write_flash_le(p, address & ~1u, 1, word);
+}
+
 void write_flash(struct jtdev *p, address_t address, address_t length, const uint8_t *buffer) {
 	address_t cursor = 0;
-	uint16_t word;
 
 	p->status = STATUS_OK;
-	if (address & 1) {
-		word = jtag_read_mem(p, 16, (address + cursor) & ~1u);
-		word = (word & 0x00ff) | (buffer[cursor] << 8);
-		jtag_write_flash_le(p, (address + cursor) & ~1u, 1, buffer + cursor);
+	if ((address & 1) && length > 0) {
+		write_flash_byte(p, address, buffer[cursor]);
+		if (p->status != STATUS_OK) {
+			return;
+		}
+		cursor += 1;
+	}
+
+	address_t num_words = (length - cursor) / 2;
+	if (loader.ram_size && num_words) {
+		write_flash_loader(p, address + cursor, num_words, buffer + cursor);
+		if (p->status != STATUS_OK) {
+			return;
+		}
+		cursor += 2 * num_words;
+	}
+
+	// Words up to the first row boundary, then whole rows in block write
+	// mode, then the remaining words of a partial row
+	num_words = (length - cursor) / 2;
+	address_t row_start = (address + cursor + JTAG_FLASH_ROW_SIZE - 1) & ~(address_t)(JTAG_FLASH_ROW_SIZE - 1);
+	address_t head_words = (row_start - (address + cursor)) / 2;
+	if (head_words > num_words) {
+		head_words = num_words;
+	}
+	address_t row_words = (num_words - head_words) & ~(address_t)(JTAG_FLASH_ROW_SIZE / 2 - 1);
+
+	if (head_words) {
+		jtag_write_flash_le(p, address + cursor, head_words, buffer + cursor);
 		if (p->status != STATUS_OK) {
 			return;
 		}
+		cursor += 2 * head_words;
+	}
+
+	if (row_words) {
+		jtag_write_flash_block_le(p, address + cursor, row_words, buffer + cursor);
+		if (p->status != STATUS_OK) {
+			return;
+		}
+		cursor += 2 * row_words;
+	}
+
+	if (length - cursor >= 2) {
+		jtag_write_flash_le(p, address + cursor, (length - cursor) / 2, buffer + cursor);
+		if (p->status != STATUS_OK) {
+			return;
+		}
+		cursor += (length - cursor) & ~1u;
+	}
+
+	if (cursor < length) {
+		write_flash_byte(p, address + cursor, buffer[cursor]);
+	}
+}
+
+// PSA runs move the PC and must not be interrupted by a watchdog reset.
+struct psa_context {
+	address_t    pc;
+	unsigned int wdtctl;
+};
+
+static void psa_save(struct jtdev *p, struct psa_context *ctx) {
+	ctx->pc = jtag_read_reg(p, 0);
+	ctx->wdtctl = jtag_wdt_hold(p);
+}
+
+// Restores even after an error, but reports the first one.
+static void psa_restore(struct jtdev *p, const struct psa_context *ctx) {
+	int status = p->status;
+
+	p->status = STATUS_OK;
+	jtag_write_reg(p, 0, ctx->pc);
+	jtag_wdt_restore(p, ctx->wdtctl);
+	if (status != STATUS_OK) {
+		p->status = status;
+	}
+}
+
+static bool verify_byte(struct jtdev *p, address_t address, uint8_t expected) {
+	uint16_t byte = jtag_read_mem(p, 8, address);
+	return p->status != STATUS_OK || (byte & 0xff) == expected;
+}
+
+address_t verify_memory(struct jtdev *p, address_t address, address_t length, const uint8_t *buffer) {
+	uint16_t words[VERIFY_CHUNK_WORDS];
+	address_t mismatch = ADDRESS_NONE;
+	address_t cursor = 0;
+
+	p->status = STATUS_OK;
+	if (length == 0) {
+		return ADDRESS_NONE;
+	}
+	if (address & 1) {
+		if (!verify_byte(p, address, buffer[cursor])) {
+			return address;
+		}
+		if (p->status != STATUS_OK) {
+			return ADDRESS_NONE;
+		}
 		cursor += 1;
 	}
 
-	jtag_write_flash_le(p, address + cursor, (length - cursor) / 2, buffer + cursor);
+	if (length - cursor >= 2) {
+		struct psa_context ctx;
+		psa_save(p, &ctx);
+		if (p->status != STATUS_OK) {
+			return ADDRESS_NONE;
+		}
+
+		while (length - cursor >= 2) {
+			address_t num_words = (length - cursor) / 2;
+			unsigned count = num_words < VERIFY_CHUNK_WORDS ? num_words : VERIFY_CHUNK_WORDS;
+			for (unsigned i = 0; i < count; i++) {
+				words[i] = buffer[cursor+2*i+0] | (buffer[cursor+2*i+1] << 8);
+			}
+			int ok = jtag_verify_mem(p, address + cursor, count, words);
+			if (p->status != STATUS_OK) {
+				break;
+			}
+			if (!ok) {
+				mismatch = address + cursor;
+				break;
+			}
+			cursor += 2 * count;
+		}
+
+		psa_restore(p, &ctx);
+		if (p->status != STATUS_OK) {
+			return ADDRESS_NONE;
+		}
+		if (mismatch != ADDRESS_NONE) {
+			return mismatch;
+		}
+	}
+
+	if (cursor < length) {
+		if (!verify_byte(p, address + cursor, buffer[cursor])) {
+			return address + cursor;
+		}
+	}
+	return ADDRESS_NONE;
+}
+
+// Program the words of a freshly erased range that aren't 0xFFFF, in runs
+// of consecutive words.
+static void write_flash_erased(struct jtdev *p, address_t address, address_t length, const uint8_t *buffer) {
+	address_t cursor = 0;
+
+	while (cursor < length) {
+		while (cursor < length && buffer[cursor] == 0xff && buffer[cursor+1] == 0xff) {
+			cursor += 2;
+		}
+		address_t start = cursor;
+		while (cursor < length && !(buffer[cursor] == 0xff && buffer[cursor+1] == 0xff)) {
+			cursor += 2;
+		}
+		if (cursor > start) {
+			write_flash(p, address + start, cursor - start, buffer + start);
+			if (p->status != STATUS_OK) {
+				return;
+			}
+		}
+	}
+}
+
+// Flash geometry: 64-byte segments in information memory, 512-byte ones in
+// main memory. F1xx/F4xx have 128-byte information segments, which are
+// erased as a whole by either of their 64-byte halves. On devices whose main
+// memory starts at 0x1100, its lowest segment is only 256 bytes.
+#define FLASH_INFO_START     0x1000
+#define FLASH_INFO_END       0x1100
+#define FLASH_INFO_SEGMENT   64
+#define FLASH_MAIN_SEGMENT   512
+#define FLASH_NUM_GRANULES   (0x10000 / FLASH_INFO_SEGMENT)
+
+static address_t flash_segment_start(address_t address) {
+	if (address < FLASH_INFO_END) {
+		return address & ~(address_t)(FLASH_INFO_SEGMENT - 1);
+	}
+	address &= ~(address_t)(FLASH_MAIN_SEGMENT - 1);
+	return address < FLASH_INFO_END ? FLASH_INFO_END : address;
+}
+
+static address_t flash_segment_end(address_t address) {
+	if (address < FLASH_INFO_END) {
+		return flash_segment_start(address) + FLASH_INFO_SEGMENT;
+	}
+	return (address & ~(address_t)(FLASH_MAIN_SEGMENT - 1)) + FLASH_MAIN_SEGMENT;
+}
+
+int erase_flash_ranges(struct jtdev *p, const address_t *ranges, unsigned num_ranges, address_t *num_erased) {
+	// Start of every segment to erase, one bit per 64 bytes
+	static uint8_t marked[FLASH_NUM_GRANULES / 8];
+	static address_t segments[FLASH_NUM_GRANULES];
+	unsigned num_segments = 0;
+
+	memset(marked, 0, sizeof marked);
+	for (unsigned i = 0; i < num_ranges; i++) {
+		address_t start = ranges[2*i+0];
+		address_t end   = start + ranges[2*i+1];
+		if (start < FLASH_INFO_START || end > 0x10000 || end < start) {
+			return -1;
+		}
+		while (start < end) {
+			address_t segment = flash_segment_start(start);
+			marked[segment / FLASH_INFO_SEGMENT / 8] |= 1u << (segment / FLASH_INFO_SEGMENT % 8);
+			start = flash_segment_end(start);
+		}
+	}
+
+	p->status = STATUS_OK;
+	*num_erased = 0;
+
+	// Skip segments that are blank already
+	struct psa_context ctx;
+	psa_save(p, &ctx);
+	if (p->status != STATUS_OK) {
+		return 0;
+	}
+	for (unsigned g = 0; g < FLASH_NUM_GRANULES; g++) {
+		if (!(marked[g / 8] & (1u << (g % 8)))) {
+			continue;
+		}
+		address_t segment = g * FLASH_INFO_SEGMENT;
+		address_t size = flash_segment_end(segment) - segment;
+		int blank = jtag_erase_check(p, segment, size / 2);
+		if (p->status != STATUS_OK) {
+			break;
+		}
+		if (!blank) {
+			segments[num_segments++] = segment;
+		}
+	}
+	psa_restore(p, &ctx);
+	if (p->status != STATUS_OK || num_segments == 0) {
+		return 0;
+	}
+
+	jtag_erase_segments(p, segments, num_segments);
+	if (p->status == STATUS_OK) {
+		*num_erased = num_segments;
+	}
+	return 0;
+}
+
+address_t sync_flash(struct jtdev *p, address_t address, address_t length,
+		address_t segment_size, const uint8_t *buffer) {
+	address_t num_changed = 0;
+
+	p->status = STATUS_OK;
+	for (address_t offset = 0; offset < length; offset += segment_size) {
+		address_t mismatch = verify_memory(p, address + offset, segment_size, buffer + offset);
+		if (p->status != STATUS_OK) {
+			return num_changed;
+		}
+		if (mismatch == ADDRESS_NONE) {
+			continue;
+		}
+
+		jtag_erase_flash(p, JTAG_ERASE_SGMT, address + offset);
+		if (p->status != STATUS_OK) {
+			return num_changed;
+		}
+		write_flash_erased(p, address + offset, segment_size, buffer + offset);
+		if (p->status != STATUS_OK) {
+			return num_changed;
+		}
+		num_changed++;
+	}
+	return num_changed;
+}
+
+void blank_check_memory(struct jtdev *p, address_t address, address_t length,
+		address_t segment_size, uint8_t *bitmap) {
+	struct psa_context ctx;
+	address_t num_segments = (length + segment_size - 1) / segment_size;
+
+	p->status = STATUS_OK;
+	memset(bitmap, 0, (num_segments + 7) / 8);
+
+	psa_save(p, &ctx);
 	if (p->status != STATUS_OK) {
 		return;
 	}
-	cursor += (length - cursor) & ~1u;
+	for (address_t i = 0; i < num_segments; i++) {
+		address_t offset = i * segment_size;
+		address_t count = length - offset < segment_size ? length - offset : segment_size;
+		int blank = jtag_erase_check(p, address + offset, count / 2);
+		if (p->status != STATUS_OK) {
+			break;
+		}
+		if (blank) {
+			bitmap[i / 8] |= 1u << (i % 8);
+		}
+	}
+	psa_restore(p, &ctx);
+}
 
-	if (cursor < length) {
-		word = jtag_read_mem(p, 16, (address + cursor) & ~1u);
-		word = (word & 0xff00) | buffer[cursor];
-		jtag_write_flash_le(p, address + cursor, 1, buffer + cursor);
+uint16_t signature_memory(struct jtdev *p, address_t address, address_t num_words) {
+	struct psa_context ctx;
+
+	p->status = STATUS_OK;
+	psa_save(p, &ctx);
+	if (p->status != STATUS_OK) {
+		return 0;
+	}
+	uint16_t signature = jtag_psa_signature(p, address, num_words);
+	psa_restore(p, &ctx);
+	return signature;
+}
+
+// CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF, MSB first
+static uint16_t crc16_update(uint16_t crc, const uint8_t *data, unsigned length) {
+	for (unsigned i = 0; i < length; i++) {
+		crc ^= data[i] << 8;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+uint16_t crc_memory(struct jtdev *p, address_t address, address_t length) {
+	uint8_t chunk[CRC_CHUNK_BYTES];
+	uint16_t crc = 0xFFFF;
+
+	p->status = STATUS_OK;
+	while (length) {
+		unsigned count = length < CRC_CHUNK_BYTES ? length : CRC_CHUNK_BYTES;
+		read_memory(p, address, count, chunk);
 		if (p->status != STATUS_OK) {
-			return;
+			return 0;
+		}
+		crc = crc16_update(crc, chunk, count);
+		address += count;
+		length  -= count;
+	}
+	return crc;
+}
+
+// Stack given to a funclet, right below its code
+#define FUNCLET_STACK_SIZE 64
+#define FUNCLET_MAX_SIZE   4096
+
+// Target RAM overwritten by a funclet, restored after it returned
+static uint8_t funclet_saved[FUNCLET_MAX_SIZE];
+
+int run_funclet(struct jtdev *p, address_t load_address, const uint8_t *code, address_t code_len,
+		address_t entry, unsigned long timeout_us, address_t *args) {
+	// The funclet returns to a "jmp $" right after its code, where it stops
+	address_t return_address = (load_address + code_len + 1) & ~1u;
+	address_t save_start = load_address - FUNCLET_STACK_SIZE;
+	address_t save_len   = return_address + 2 - save_start;
+	if ((load_address & 1) || load_address < QUICK_ACCESS_START + FUNCLET_STACK_SIZE
+	    || return_address + 2 > QUICK_ACCESS_END || save_len > FUNCLET_MAX_SIZE) {
+		return -1;
+	}
+
+	struct run_context ctx;
+	address_t regs[JTAG_NUM_REGS];
+	const uint8_t stop[2] = { 0xff, 0x3f }; // jmp $
+
+	p->status = STATUS_OK;
+	run_save(p, &ctx);
+	if (p->status != STATUS_OK) {
+		return 0;
+	}
+
+	// read_memory() and write_ram() start over with a clean status, so each
+	// step only runs if the ones before it succeeded
+	read_memory(p, save_start, save_len, funclet_saved);
+	if (p->status == STATUS_OK) {
+		ctx.ram_start = save_start;
+		ctx.ram_len   = save_len;
+		ctx.ram       = funclet_saved;
+		write_ram(p, load_address, code_len, code);
+	}
+	if (p->status == STATUS_OK) {
+		write_ram(p, return_address, 2, stop);
+	}
+	if (p->status == STATUS_OK) {
+		jtag_write_mem(p, 16, load_address - 2, return_address);
+		jtag_set_breakpoint(p, RUN_BREAKPOINT, return_address);
+	}
+
+	if (p->status == STATUS_OK) {
+		memcpy(regs, ctx.regs, sizeof regs);
+		regs[0] = entry;
+		regs[1] = load_address - 2;
+		regs[2] = 0; // SR: interrupts off, CPU on
+		for (int i = 0; i < 4; i++) {
+			regs[12+i] = args[i];
+		}
+		bool returned = run_to_breakpoint(p, regs, timeout_us);
+		if (p->status == STATUS_OK && !returned) {
+			p->status = STATUS_TIMED_OUT;
+		}
+		if (p->status == STATUS_OK) {
+			for (int i = 0; i < 4; i++) {
+				args[i] = regs[12+i];
+			}
 		}
 	}
+
+	run_restore(p, &ctx);
+	return 0;
 }
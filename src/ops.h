@@ -9,4 +9,46 @@ void read_memory(struct jtdev *p, address_t address, address_t length, uint8_t *
 void write_ram(struct jtdev *p, address_t address, address_t length, const uint8_t *buffer);
 void write_flash(struct jtdev *p, address_t address, address_t length, const uint8_t *buffer);
 
+// Let write_flash() run a flash loader on the target, in the target RAM
+// given, clocking the flash controller with fctl2 (including FWKEY).
+// ram_size 0 programs flash over JTAG again. Returns -1 if the RAM is too
+// small or outside of the quick access range.
+int set_flash_loader(address_t ram_start, address_t ram_size, uint16_t fctl2);
+
+// Verify memory against buffer without resetting the target. Returns the
+// start of the first chunk that differs, or ADDRESS_NONE if all of it matches.
+address_t verify_memory(struct jtdev *p, address_t address, address_t length, const uint8_t *buffer);
+
+// Erase the flash segments covering a list of (start, length) ranges,
+// except for those that are blank already. Segments are 64 bytes in
+// information memory and 512 bytes in main memory. Returns -1 if a range
+// lies outside of 0x1000-0xFFFF.
+int erase_flash_ranges(struct jtdev *p, const address_t *ranges, unsigned num_ranges, address_t *num_erased);
+
+// Bring a range of whole flash segments up to date with buffer: segments
+// whose PSA signature differs are erased and reprogrammed, skipping words
+// that are 0xFFFF. Returns the number of segments reprogrammed.
+address_t sync_flash(struct jtdev *p, address_t address, address_t length,
+		address_t segment_size, const uint8_t *buffer);
+
+// Erase check every segment of a word-aligned range, the last one possibly
+// shorter. Bit i of the bitmap (LSB first) is set if segment i is blank.
+void blank_check_memory(struct jtdev *p, address_t address, address_t length,
+		address_t segment_size, uint8_t *bitmap);
+
+// PSA signature the target computes over a word-aligned range, seeded with
+// address-2 and using the polynomial 0x0805. The target is not reset.
+uint16_t signature_memory(struct jtdev *p, address_t address, address_t num_words);
+
+// Load code into target RAM at load_address and call it at entry, with
+// R12-R15 taken from args, until it returns or timeout_us has passed. The
+// results in R12-R15 go back to args. Registers, the watchdog and the RAM
+// used for code and stack are restored afterwards. Returns -1 if the code
+// doesn't fit into RAM.
+int run_funclet(struct jtdev *p, address_t load_address, const uint8_t *code, address_t code_len,
+		address_t entry, unsigned long timeout_us, address_t *args);
+
+// CRC-16/CCITT-FALSE the probe computes over a range it reads from the target.
+uint16_t crc_memory(struct jtdev *p, address_t address, address_t length);
+
 #endif
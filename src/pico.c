@@ -1,38 +1,74 @@
+#include <strings.h>
+
 #include <pico.h>
 #include <pico/status_led.h>
 #include <hardware/watchdog.h>
 #include <hardware/gpio.h>
+#include <hardware/clocks.h>
 #include <tusb.h>
 
 #include "picofet_proto.h"
 #include "pinout.h"
 #include "jtaglib.h"
 #include "jtdev.h"
+#include "pico_dev.h"
 #include "comm.h"
 #include "cmd.h"
 
 // JTAG device declaration & plumbing code
 
+#define PICO_DEV_TCK_HZ 250000
+#define PICO_DEV_TCLK_STROBE_HZ 350000
+
+// TCK and TCLK edges are followed by a busy wait of pico_dev_edge_delay cycles.
+// pico_dev_edge_overhead is the number of cycles an edge takes without any
+// delay, as measured by pico_dev_calibrate().
+static uint32_t pico_dev_edge_delay;
+static uint32_t pico_dev_edge_overhead;
+
+// Record the level driven onto a pin in the shadow pin state.
+static inline void pico_dev_shadow(struct jtdev *p, uint8_t bit, int out) {
+	if (out) {
+		p->pin_level |= bit;
+	} else {
+		p->pin_level &= ~bit;
+	}
+}
+
+// Drive a pin, touching SIO only if its direction or level changes.
+static inline void pico_dev_drive(struct jtdev *p, uint8_t bit, int pin, int out) {
+	if (!(p->pin_output & bit)) {
+		gpio_set_dir(pin, GPIO_OUT);
+		p->pin_output |= bit;
+	} else if (!(p->pin_level & bit) == !out) {
+		return;
+	}
+	gpio_put(pin, out);
+	pico_dev_shadow(p, bit, out);
+}
+
+// TCK changes level on nearly every call, so it is written unconditionally.
+// This also keeps the edge timing measured by pico_dev_calibrate() valid.
 void pico_dev_tck(struct jtdev *p, int out) {
 	gpio_put(p->pin_tck, out);
-	sleep_us(2);
+	pico_dev_shadow(p, JTDEV_PIN_TCK, out);
+	busy_wait_at_least_cycles(pico_dev_edge_delay);
 }
 
 void pico_dev_tms(struct jtdev *p, int out) {
-	gpio_put(p->pin_tms, out);
+	pico_dev_drive(p, JTDEV_PIN_TMS, p->pin_tms, out);
 }
 
 void pico_dev_tdi(struct jtdev *p, int out) {
-	gpio_set_dir(p->pin_tdi, GPIO_OUT);
-	gpio_put(p->pin_tdi, out);
+	pico_dev_drive(p, JTDEV_PIN_TDI, p->pin_tdi, out);
 }
 
 void pico_dev_rst(struct jtdev *p, int out) {
-	gpio_put(p->pin_rst, out);
+	pico_dev_drive(p, JTDEV_PIN_RST, p->pin_rst, out);
 }
 
 void pico_dev_tst(struct jtdev *p, int out) {
-	gpio_put(p->pin_tst, out);
+	pico_dev_drive(p, JTDEV_PIN_TST, p->pin_tst, out);
 }
 
 int pico_dev_tdo_get(struct jtdev *p) {
@@ -40,47 +76,116 @@ int pico_dev_tdo_get(struct jtdev *p) {
 }
 
 void pico_dev_tclk(struct jtdev *p, int out) {
-	gpio_set_dir(p->pin_tdi, GPIO_OUT);
-	gpio_put(p->pin_tdi, out);
-	sleep_us(2);
+	pico_dev_drive(p, JTDEV_PIN_TDI, p->pin_tdi, out);
+	busy_wait_at_least_cycles(pico_dev_edge_delay);
 }
 
+// TCLK is driven by us, so the last level written is the current one.
 int pico_dev_tclk_get(struct jtdev *p) {
-	gpio_set_dir(p->pin_tdi, GPIO_IN);
-	return gpio_get(p->pin_tdi);
+	return !!(p->pin_level & JTDEV_PIN_TDI);
 }
 
+// Deliberately independent of the TCK frequency set by pico_dev_set_speed().
+// The busy waits only guarantee a lower bound on the strobe period, so an
+// interrupt during a burst lowers the frequency for that strobe.
 void pico_dev_tclk_strobe(struct jtdev *p, unsigned int count) {
-	gpio_set_dir(p->pin_tdi, GPIO_OUT);
+	uint32_t half_period = clock_get_hz(clk_sys) / (2 * p->tclk_strobe_hz);
+
+	if (!count) {
+		return;
+	}
+	if (!(p->pin_output & JTDEV_PIN_TDI)) {
+		gpio_set_dir(p->pin_tdi, GPIO_OUT);
+		p->pin_output |= JTDEV_PIN_TDI;
+	}
+	pico_dev_shadow(p, JTDEV_PIN_TDI, 1);
 	while (count) {
 		gpio_put(p->pin_tdi, 0);
+		busy_wait_at_least_cycles(half_period);
 		gpio_put(p->pin_tdi, 1);
-		// The FLASH controller needs a clock rate of 350kHz +- 100kHz.
-		// Sleeping 3 microseconds should give us a frequency of around 333kHz.
-		sleep_us(3);
+		busy_wait_at_least_cycles(half_period);
 		count--;
 	}
 }
 
+// Measure how many cycles a TCK edge takes without any extra delay, over the
+// shift loop of a real scan as jtag_default_shift() clocks it: TDI toggling
+// on every bit, TMS set on the last one and TDO sampled. TCK, TMS and TDI
+// are inputs while measuring, so the target sees no edges.
+static void pico_dev_calibrate(struct jtdev *p) {
+	const unsigned num_scans = 256;
+	const unsigned num_bits = 16;
+	uint32_t pins = (1u << p->pin_tck) | (1u << p->pin_tms) | (1u << p->pin_tdi);
+
+	pico_dev_edge_delay = 0;
+	gpio_set_dir_in_masked(pins);
+	uint64_t start = time_us_64();
+	for (unsigned i = 0; i < num_scans; i++) {
+		p->f->jtdev_tms(p, 0);
+		for (unsigned mask = 1u << (num_bits - 1); mask; mask >>= 1) {
+			p->f->jtdev_tdi(p, mask & 0x5555);
+			if (mask == 1) {
+				p->f->jtdev_tms(p, 1);
+			}
+			p->f->jtdev_tck(p, 0);
+			p->f->jtdev_tck(p, 1);
+			p->f->jtdev_tdo_get(p);
+		}
+	}
+	uint64_t elapsed = time_us_64() - start;
+	// Back to driving the levels last written, as recorded in pin_level
+	gpio_set_dir_out_masked(pins);
+
+	pico_dev_edge_overhead = elapsed * (clock_get_hz(clk_sys) / 1000000)
+	                       / (2 * num_scans * num_bits);
+}
+
+uint32_t pico_dev_edge_delay_for(unsigned long hz, uint32_t overhead, unsigned long *actual) {
+	uint32_t sys_hz = clock_get_hz(clk_sys);
+	uint32_t half_period = hz ? sys_hz / (2 * (uint64_t)hz) : UINT32_MAX;
+	uint32_t delay = half_period > overhead ? half_period - overhead : 0;
+
+	// Round the half period up, so that we never report more than we achieve
+	half_period = delay + overhead;
+	*actual = sys_hz / (2 * (uint64_t)(half_period ? half_period : 1));
+	return delay;
+}
+
+unsigned long pico_dev_set_speed(struct jtdev *p, unsigned long hz) {
+	pico_dev_edge_delay = pico_dev_edge_delay_for(hz, pico_dev_edge_overhead, &p->tck_hz);
+	return p->tck_hz;
+}
+
 void pico_dev_led_green(__unused struct jtdev *p, int out) {
 	status_led_set_state(out);
 }
 
 void pico_dev_led_red(__unused struct jtdev *p, __unused int out) {}
 
+// Keep USB serviced while waiting for the JTAG hardware to finish.
+void pico_dev_idle(void) {
+	watchdog_update();
+	tud_task();
+}
+
 void pico_dev_power_on (__unused struct jtdev *p) {}
 void pico_dev_power_off(__unused struct jtdev *p) {}
 void pico_dev_connect  (__unused struct jtdev *p) {}
 void pico_dev_release  (__unused struct jtdev *p) {}
 
 int pico_dev_open(struct jtdev *p, __unused const char *device) {
-	extern const struct jtdev_func pico_dev_func;
-
 	// Fill out the JTAG device structure
 
 	p->f = &pico_dev_func;
 	p->status = STATUS_OK;
 	p->attached = false;
+	p->cpu_halted = false;
+	p->tck_auto = false;
+	p->jtag_id = 0;
+	p->ir_cache = -1;
+	p->tap_state = JTAG_TAP_UNKNOWN;
+	p->tclk_strobe_hz = PICO_DEV_TCLK_STROBE_HZ;
+	p->queue_count = 0;
 	p->pin_tck = PIN_TCK;
 	p->pin_tms = PIN_TMS;
 	p->pin_tdi = PIN_TDI;
@@ -109,6 +214,14 @@ int pico_dev_open(struct jtdev *p, __unused const char *device) {
 	
 	gpio_init(p->pin_tst);
 	gpio_set_dir(p->pin_tst, GPIO_OUT);
+
+	// gpio_init() leaves every pin driven low
+	p->pin_level = 0;
+	p->pin_output = JTDEV_PIN_TCK | JTDEV_PIN_TMS | JTDEV_PIN_TDI
+	              | JTDEV_PIN_RST | JTDEV_PIN_TST;
+
+	pico_dev_calibrate(p);
+	pico_dev_set_speed(p, PICO_DEV_TCK_HZ);
 	
 	return 0;
 }
@@ -137,6 +250,8 @@ const struct jtdev_func pico_dev_func = {
 	.jtdev_tst = pico_dev_tst,
 	.jtdev_tdo_get = pico_dev_tdo_get,
 
+	.jtdev_set_speed = pico_dev_set_speed,
+
 	.jtdev_tclk        = pico_dev_tclk,
 	.jtdev_tclk_get    = pico_dev_tclk_get,
 	.jtdev_tclk_strobe = pico_dev_tclk_strobe,
@@ -147,10 +262,43 @@ const struct jtdev_func pico_dev_func = {
 	.jtdev_ir_shift     = jtag_default_ir_shift,
 	.jtdev_dr_shift_8   = jtag_default_dr_shift_8,
 	.jtdev_dr_shift_16  = jtag_default_dr_shift_16,
+	.jtdev_dr_write_16  = jtag_default_dr_write_16,
+	.jtdev_dr_capture_16 = jtag_default_dr_capture_16,
 	.jtdev_tms_sequence = jtag_default_tms_sequence,
 	.jtdev_init_dap     = jtag_default_init_dap,
+	.jtdev_run_queue    = jtag_default_run_queue,
 };
 
+unsigned long cmd_time_us(void) {
+	return time_us_32();
+}
+
+// Reopen the JTAG device on another transport. Speed settings return to
+// their defaults, and the target has to be attached again.
+int cmd_set_transport(struct jtdev *p, const char *name) {
+#ifdef PICOFET_STATIC_JTDEV
+	// jtaglib.c is bound to the 4-wire bit-banged device
+	(void)p;
+	return strcasecmp(name, "JTAG") == 0 ? 0 : -1;
+#else
+	const struct jtdev_func *f;
+	if (strcasecmp(name, "JTAG") == 0) {
+		f = &pio_dev_func;
+	} else if (strcasecmp(name, "SBW") == 0) {
+		f = &sbw_dev_func;
+	} else {
+		return -1;
+	}
+
+	p->f->jtdev_close(p);
+	if (f->jtdev_open(p, NULL) < 0) {
+		pio_dev_func.jtdev_open(p, NULL);
+		return -1;
+	}
+	return 0;
+#endif
+}
+
 // Communication with host via (Tiny)USB
 
 void comm_tusb_open(struct comm *t) {
@@ -223,7 +371,13 @@ int main() {
 	comm_tusb_func.comm_open(&comm);
 
 	struct jtdev jtdev;
-	pico_dev_func.jtdev_open(&jtdev, NULL);
+#ifdef PICOFET_STATIC_JTDEV
+	// jtaglib.c calls the primitives of this device directly
+	sio_dev_func.jtdev_open(&jtdev, NULL);
+#else
+	// Falls back to the bit-banged device if no PIO state machine is available
+	pio_dev_func.jtdev_open(&jtdev, NULL);
+#endif
 
 #if 0
 	if (watchdog_caused_reboot()) {
@@ -234,7 +388,7 @@ int main() {
 	command_loop(&jtdev, &comm);
 
 	// Not reached
-	pico_dev_func.jtdev_close(&jtdev);
+	jtdev.f->jtdev_close(&jtdev);
 
 	return 0;
 }
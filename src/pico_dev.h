@@ -0,0 +1,49 @@
+#ifndef PICOFET_PICO_DEV_H_
+#define PICOFET_PICO_DEV_H_
+
+// Bit-banged JTAG primitives on the RP2XYZ GPIO pins.
+// Other backends fall back to these for anything they don't accelerate.
+
+#include <stdint.h>
+
+struct jtdev; // declared somewhere else
+
+int  pico_dev_open(struct jtdev *p, const char *device);
+void pico_dev_close(struct jtdev *p);
+
+void pico_dev_tck(struct jtdev *p, int out);
+void pico_dev_tms(struct jtdev *p, int out);
+void pico_dev_tdi(struct jtdev *p, int out);
+void pico_dev_rst(struct jtdev *p, int out);
+void pico_dev_tst(struct jtdev *p, int out);
+int  pico_dev_tdo_get(struct jtdev *p);
+
+unsigned long pico_dev_set_speed(struct jtdev *p, unsigned long hz);
+
+// Busy-wait cycles to add to an edge that takes overhead cycles by itself,
+// so that TCK does not exceed hz. Stores the resulting frequency in *actual.
+uint32_t pico_dev_edge_delay_for(unsigned long hz, uint32_t overhead, unsigned long *actual);
+
+void pico_dev_tclk(struct jtdev *p, int out);
+int  pico_dev_tclk_get(struct jtdev *p);
+void pico_dev_tclk_strobe(struct jtdev *p, unsigned int count);
+
+void pico_dev_idle(void);
+
+void pico_dev_led_green(struct jtdev *p, int out);
+void pico_dev_led_red(struct jtdev *p, int out);
+
+void pico_dev_power_on (struct jtdev *p);
+void pico_dev_power_off(struct jtdev *p);
+void pico_dev_connect  (struct jtdev *p);
+void pico_dev_release  (struct jtdev *p);
+
+int  sio_dev_open(struct jtdev *p, const char *device);
+unsigned long sio_dev_set_speed(struct jtdev *p, unsigned long hz);
+
+extern const struct jtdev_func pico_dev_func;
+extern const struct jtdev_func sio_dev_func;
+extern const struct jtdev_func pio_dev_func;
+extern const struct jtdev_func sbw_dev_func;
+
+#endif
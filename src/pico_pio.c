@@ -0,0 +1,778 @@
+#include <pico.h>
+#include <pico/time.h>
+#include <hardware/pio.h>
+#include <hardware/gpio.h>
+#include <hardware/clocks.h>
+#include <hardware/dma.h>
+#include <hardware/irq.h>
+#include <hardware/sync.h>
+
+#include "jtag.pio.h"
+#include "sbw.pio.h"
+
+#include "picofet_proto.h"
+#include "jtaglib.h"
+#include "jtdev.h"
+#include "pico_dev.h"
+#include "pinout.h"
+
+// JTAG device running IR/DR scans and TCLK edges on a PIO state machine.
+//
+// TCK, TMS and TDI are owned by either the state machine or SIO at any time.
+// Scans and TCLK edges claim them for the state machine, everything else
+// (TAP reset, entry sequence, flash strobes) hands them back to SIO and
+// uses the bit-banged primitives from pico.c.
+//
+// Queued operations are encoded into one buffer of state machine words that
+// is fed to the TX FIFO by DMA, while a second DMA channel collects the TDO
+// values of the scans whose results are needed.
+//
+// Flash strobes run on a second state machine at the full system clock,
+// which drives TDI while the first one is idle. The CPU keeps servicing USB
+// until the completion interrupt of the burst arrives.
+//
+// The Spy-Bi-Wire device runs the sbw program instead, on the TEST (SBWTCK)
+// and RST (SBWTDIO) pins. It shares the encoders, the DMA queue runner and
+// the scan hooks with the JTAG device. Flash strobes are TCLK edges of a
+// long scan in Run-Test/Idle, as there is no separate TDI line to strobe.
+
+#define PIO_DEV_TCK_HZ 1000000
+
+// Strobe bursts shorter than this are waited for without servicing USB.
+// They belong to flash word and block writes, whose cumulative program time
+// must not be stretched. Erasures strobe thousands of times per burst.
+#define PIO_DEV_STROBE_IDLE_MIN 1024
+
+// The slots of a TCK cycle keep SBWTCK low for 1/6 of it, which must not
+// exceed 7 us, so Spy-Bi-Wire can't go slower than about 24 kHz.
+#define SBW_DEV_MIN_TCK_HZ 50000
+
+// Longest strobe burst in a single scan
+#define SBW_DEV_STROBE_MAX_COUNT (1u << 24)
+
+// The shadow pin state of SBWTCK and SBWTDIO is that of TEST and RST
+#if PIN_SBWTCK != PIN_TST || PIN_SBWTDIO != PIN_RST
+#  error "Spy-Bi-Wire must run on the TST and RST pins."
+#endif
+
+// Longest encoding of a single queued operation, in state machine words
+#define PIO_DEV_MAX_OP_WORDS 3
+
+static PIO  pio_dev_pio;
+static uint pio_dev_sm;
+static uint pio_dev_offset;
+static bool pio_dev_sbw;
+static const pio_program_t *pio_dev_program;
+static uint pio_dev_cycles_per_tck;
+static uint32_t pio_dev_div256;
+static bool pio_dev_owns_pins;
+static int  pio_dev_tms_level;
+static int  pio_dev_tclk_level;
+
+static int      pio_dev_dma_tx = -1;
+static int      pio_dev_dma_rx = -1;
+static uint32_t pio_dev_words[JTDEV_QUEUE_CAPACITY * PIO_DEV_MAX_OP_WORDS];
+static uint32_t pio_dev_captures[JTDEV_QUEUE_CAPACITY];
+
+static int           pio_dev_strobe_sm = -1;
+static uint          pio_dev_strobe_offset;
+static volatile bool pio_dev_strobe_busy;
+
+// Wait until the state machine has run everything queued in its TX FIFO.
+static void pio_dev_sync(void) {
+	uint32_t stall = 1u << (PIO_FDEBUG_TXSTALL_LSB + pio_dev_sm);
+
+	if (!pio_dev_owns_pins) {
+		return;
+	}
+	pio_dev_pio->fdebug = stall;
+	while (!(pio_dev_pio->fdebug & stall)) {
+		tight_loop_contents();
+	}
+}
+
+static void pio_dev_claim_pins(struct jtdev *p) {
+	if (pio_dev_owns_pins) {
+		return;
+	}
+
+	if (pio_dev_sbw) {
+		int sbwtck_level = !!(p->pin_level & JTDEV_PIN_TST);
+		pio_dev_tclk_level = !!(p->pin_level & JTDEV_PIN_RST);
+
+		uint32_t mask = (1u << p->pin_tst) | (1u << p->pin_rst);
+		uint32_t values = ((uint32_t)sbwtck_level << p->pin_tst)
+		                | ((uint32_t)pio_dev_tclk_level << p->pin_rst);
+
+		// The sbw program restores TCLK from Y in every TMS slot
+		pio_sm_set_enabled(pio_dev_pio, pio_dev_sm, false);
+		pio_sm_set_pins_with_mask(pio_dev_pio, pio_dev_sm, values, mask);
+		pio_sm_exec(pio_dev_pio, pio_dev_sm, pio_encode_set(pio_y, pio_dev_tclk_level));
+		pio_sm_set_enabled(pio_dev_pio, pio_dev_sm, true);
+
+		pio_gpio_init(pio_dev_pio, p->pin_tst);
+		pio_gpio_init(pio_dev_pio, p->pin_rst);
+		pio_dev_owns_pins = true;
+		return;
+	}
+
+	// Continue at the levels SIO left the pins at, so that switching over
+	// can never produce a spurious TCK or TCLK edge.
+	int tck_level = !!(p->pin_level & JTDEV_PIN_TCK);
+	pio_dev_tms_level  = !!(p->pin_level & JTDEV_PIN_TMS);
+	pio_dev_tclk_level = !!(p->pin_level & JTDEV_PIN_TDI);
+
+	uint32_t mask = (1u << p->pin_tck) | (1u << p->pin_tms) | (1u << p->pin_tdi);
+	uint32_t values = ((uint32_t)tck_level << p->pin_tck)
+	                | ((uint32_t)pio_dev_tms_level << p->pin_tms)
+	                | ((uint32_t)pio_dev_tclk_level << p->pin_tdi);
+
+	pio_sm_set_enabled(pio_dev_pio, pio_dev_sm, false);
+	pio_sm_set_pins_with_mask(pio_dev_pio, pio_dev_sm, values, mask);
+	pio_sm_set_enabled(pio_dev_pio, pio_dev_sm, true);
+
+	pio_gpio_init(pio_dev_pio, p->pin_tck);
+	pio_gpio_init(pio_dev_pio, p->pin_tms);
+	pio_gpio_init(pio_dev_pio, p->pin_tdi);
+	pio_dev_owns_pins = true;
+}
+
+static void pio_dev_release_pins(struct jtdev *p) {
+	if (!pio_dev_owns_pins) {
+		return;
+	}
+	pio_dev_sync();
+
+	if (pio_dev_sbw) {
+		// Scans always leave SBWTCK high and SBWTDIO at the TCLK level
+		gpio_put(p->pin_tst, 1);
+		gpio_put(p->pin_rst, pio_dev_tclk_level);
+		gpio_set_dir(p->pin_rst, GPIO_OUT);
+
+		p->pin_level &= ~JTDEV_PIN_RST;
+		p->pin_level |= JTDEV_PIN_TST | (pio_dev_tclk_level ? JTDEV_PIN_RST : 0);
+		p->pin_output |= JTDEV_PIN_TST | JTDEV_PIN_RST;
+
+		gpio_set_function(p->pin_tst, GPIO_FUNC_SIO);
+		gpio_set_function(p->pin_rst, GPIO_FUNC_SIO);
+		pio_dev_owns_pins = false;
+		return;
+	}
+
+	// Scans and TCLK edges always leave TCK high and TDI at the TCLK level
+	gpio_put(p->pin_tck, 1);
+	gpio_put(p->pin_tms, pio_dev_tms_level);
+	gpio_put(p->pin_tdi, pio_dev_tclk_level);
+	gpio_set_dir(p->pin_tdi, GPIO_OUT);
+
+	p->pin_level &= ~(JTDEV_PIN_TMS | JTDEV_PIN_TDI);
+	p->pin_level |= JTDEV_PIN_TCK
+	             | (pio_dev_tms_level ? JTDEV_PIN_TMS : 0)
+	             | (pio_dev_tclk_level ? JTDEV_PIN_TDI : 0);
+	p->pin_output |= JTDEV_PIN_TCK | JTDEV_PIN_TMS | JTDEV_PIN_TDI;
+
+	gpio_set_function(p->pin_tck, GPIO_FUNC_SIO);
+	gpio_set_function(p->pin_tms, GPIO_FUNC_SIO);
+	gpio_set_function(p->pin_tdi, GPIO_FUNC_SIO);
+	pio_dev_owns_pins = false;
+}
+
+// Spread the low 16 bits of x to the even bit positions.
+static inline uint32_t pio_dev_spread(uint32_t x) {
+	x &= 0xffff;
+	x = (x | (x << 8)) & 0x00ff00ff;
+	x = (x | (x << 4)) & 0x0f0f0f0f;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+// Interleave the low 16 TMS and TDI bits into the (TDI, TMS) pairs of the
+// jtag program, or the (TMS, TDI) pairs of the sbw program.
+static inline uint32_t pio_dev_pairs(uint32_t tms, uint32_t tdi) {
+	if (pio_dev_sbw) {
+		return (pio_dev_spread(tms) << 1) | pio_dev_spread(tdi);
+	}
+	return (pio_dev_spread(tdi) << 1) | pio_dev_spread(tms);
+}
+
+// Encode a transaction clocking up to 31 TCK cycles into w.
+// tms and tdi hold one bit per cycle, the first cycle in bit 31.
+// If capture is set, the state machine pushes the TDO bits of all cycles,
+// the last cycle in bit 0. Returns the number of words used.
+static int pio_dev_encode_scan(uint32_t *w, int cycles, uint32_t tms, uint32_t tdi, bool capture) {
+	int n = 0;
+
+	// TDI past the last cycle must not read as the capture flag
+	tdi &= ~(0xffffffffu >> cycles);
+	if (capture) {
+		tdi |= 0x80000000u >> cycles;
+	}
+
+	w[n++] = 0x80000000u | (cycles - 1);
+	w[n++] = pio_dev_pairs(tms >> 16, tdi >> 16);
+	if (cycles >= 16) {
+		w[n++] = pio_dev_pairs(tms, tdi);
+	}
+	pio_dev_tms_level = (tms >> (32 - cycles)) & 1;
+	return n;
+}
+
+// Encode a scan shifting bits of data MSB first through the IR or DR,
+// starting in Run-Test/Idle or Update-xR and ending in Update-xR, with TDI
+// held at the TCLK level outside of Shift-xR. This is the same sequence of
+// states jtag_default_shift() goes through.
+static int pio_dev_encode_shift(uint32_t *w, bool ir, int bits, uint32_t data, bool capture) {
+	int head = ir ? 4 : 3;
+	uint32_t field = (0xffffffffu >> (32 - bits)) << (32 - head - bits);
+	uint32_t tms, tdi;
+
+	// Run-Test/Idle or Update-xR -> Shift-xR, Shift-xR -> Exit1-xR -> Update-xR
+	tms = (ir ? 0xc0000000u : 0x80000000u)
+	    | (0x80000000u >> (head + bits - 1))
+	    | (0x80000000u >> (head + bits));
+	tdi = pio_dev_tclk_level ? ~field : 0;
+	tdi |= (data << (32 - head - bits)) & field;
+
+	return pio_dev_encode_scan(w, head + bits + 1, tms, tdi, capture);
+}
+
+static int pio_dev_encode_tms_sequence(uint32_t *w, int bits, unsigned int value) {
+	uint32_t tms = 0;
+
+	for (int i = 0; i < bits; i++) {
+		if (value & (1u << i)) {
+			tms |= 0x80000000u >> i;
+		}
+	}
+	return pio_dev_encode_scan(w, bits, tms, pio_dev_tclk_level ? ~0u : 0, false);
+}
+
+static int pio_dev_encode_tclk(uint32_t *w, int out) {
+	int n = 1;
+
+	if (pio_dev_sbw) {
+		// A TCK cycle in Run-Test/Idle, TCLK changes in its TDI slot
+		n = pio_dev_encode_scan(w, 1, 0, out ? 0x80000000u : 0, false);
+	} else {
+		w[0] = out ? 0x40000000u : 0;
+	}
+	pio_dev_tclk_level = out;
+	return n;
+}
+
+// Extract the data bits of a shift from the captured TDO bits, the last
+// of which is that of the Exit1-xR -> Update-xR cycle
+static inline uint32_t pio_dev_shift_result(uint32_t tdo, int bits) {
+	return (tdo >> 1) & (0xffffffffu >> (32 - bits));
+}
+
+static void pio_dev_put(const uint32_t *w, int n) {
+	for (int i = 0; i < n; i++) {
+		pio_sm_put_blocking(pio_dev_pio, pio_dev_sm, w[i]);
+	}
+}
+
+static uint32_t pio_dev_shift(struct jtdev *p, bool ir, int bits, uint32_t data) {
+	uint32_t w[PIO_DEV_MAX_OP_WORDS];
+
+	pio_dev_claim_pins(p);
+	pio_dev_put(w, pio_dev_encode_shift(w, ir, bits, data, true));
+	return pio_dev_shift_result(pio_sm_get_blocking(pio_dev_pio, pio_dev_sm), bits);
+}
+
+uint8_t pio_dev_ir_shift(struct jtdev *p, uint8_t ir) {
+	return pio_dev_shift(p, true, 8, ir);
+}
+
+uint8_t pio_dev_dr_shift_8(struct jtdev *p, uint8_t dr) {
+	return pio_dev_shift(p, false, 8, dr);
+}
+
+uint16_t pio_dev_dr_shift_16(struct jtdev *p, uint16_t dr) {
+	return pio_dev_shift(p, false, 16, dr);
+}
+
+// Nothing is pushed to the RX FIFO, so there is nothing to wait for either
+void pio_dev_dr_write_16(struct jtdev *p, uint16_t dr) {
+	uint32_t w[PIO_DEV_MAX_OP_WORDS];
+
+	pio_dev_claim_pins(p);
+	pio_dev_put(w, pio_dev_encode_shift(w, false, 16, dr, false));
+}
+
+uint16_t pio_dev_dr_capture_16(struct jtdev *p) {
+	return pio_dev_shift(p, false, 16, 0x0000);
+}
+
+void pio_dev_tms_sequence(struct jtdev *p, int bits, unsigned int value) {
+	uint32_t w[PIO_DEV_MAX_OP_WORDS];
+
+	pio_dev_claim_pins(p);
+	pio_dev_put(w, pio_dev_encode_tms_sequence(w, bits, value));
+}
+
+void pio_dev_tclk(struct jtdev *p, int out) {
+	uint32_t w[PIO_DEV_MAX_OP_WORDS];
+
+	pio_dev_claim_pins(p);
+	pio_dev_put(w, pio_dev_encode_tclk(w, out));
+}
+
+// State machine clock divider for a TCK frequency of at most hz, in 1/256ths
+static uint32_t pio_dev_clkdiv256(unsigned long hz) {
+	uint64_t cycles_hz = (uint64_t)(hz ? hz : 1) * pio_dev_cycles_per_tck;
+	uint64_t div256 = ((uint64_t)clock_get_hz(clk_sys) * 256 + cycles_hz - 1) / cycles_hz;
+
+	if (div256 < 0x100) {
+		div256 = 0x100;
+	} else if (div256 > 0xffffff) {
+		div256 = 0xffffff;
+	}
+	return div256;
+}
+
+unsigned long pio_dev_set_speed(struct jtdev *p, unsigned long hz) {
+	if (pio_dev_sbw && hz < SBW_DEV_MIN_TCK_HZ) {
+		hz = SBW_DEV_MIN_TCK_HZ;
+	}
+	pio_dev_div256 = pio_dev_clkdiv256(hz);
+
+	// The TAP reset and entry sequence still run on the bit-banged primitives
+	pico_dev_set_speed(p, hz);
+
+	pio_dev_sync();
+	pio_sm_set_clkdiv(pio_dev_pio, pio_dev_sm, pio_dev_div256 / 256.0f);
+
+	p->tck_hz = (uint64_t)clock_get_hz(clk_sys) * 256
+	          / ((uint64_t)pio_dev_div256 * pio_dev_cycles_per_tck);
+	return p->tck_hz;
+}
+
+void pio_dev_run_queue(struct jtdev *p, const struct jtag_op *ops, unsigned int count) {
+	unsigned int num_words = 0, num_captures = 0;
+
+	if (pio_dev_dma_tx < 0 || pio_dev_dma_rx < 0) {
+		jtag_default_run_queue(p, ops, count);
+		return;
+	}
+
+	pio_dev_claim_pins(p);
+
+	for (unsigned int i = 0; i < count; i++) {
+		const struct jtag_op *op = &ops[i];
+		uint32_t *w = pio_dev_words + num_words;
+
+		switch (op->type) {
+		case JTAG_OP_IR_SHIFT:
+		case JTAG_OP_DR_SHIFT:
+			num_words += pio_dev_encode_shift(w, op->type == JTAG_OP_IR_SHIFT,
+				op->bits, op->value, op->result != NULL);
+			num_captures += op->result != NULL;
+			break;
+		case JTAG_OP_TCLK:
+			num_words += pio_dev_encode_tclk(w, op->value);
+			break;
+		case JTAG_OP_TMS_SEQUENCE:
+			num_words += pio_dev_encode_tms_sequence(w, op->bits, op->value);
+			break;
+		}
+	}
+
+	// Both channels were configured in pio_dev_open(), only addresses
+	// and transfer counts change between bursts.
+	dma_channel_set_read_addr(pio_dev_dma_tx, pio_dev_words, false);
+	dma_channel_set_trans_count(pio_dev_dma_tx, num_words, false);
+	if (num_captures) {
+		dma_channel_set_write_addr(pio_dev_dma_rx, pio_dev_captures, false);
+		dma_channel_set_trans_count(pio_dev_dma_rx, num_captures, false);
+		dma_start_channel_mask((1u << pio_dev_dma_tx) | (1u << pio_dev_dma_rx));
+		dma_channel_wait_for_finish_blocking(pio_dev_dma_rx);
+	} else {
+		dma_channel_start(pio_dev_dma_tx);
+	}
+	// The word buffer is reused by the next burst
+	dma_channel_wait_for_finish_blocking(pio_dev_dma_tx);
+
+	num_captures = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		if (ops[i].result) {
+			*ops[i].result = pio_dev_shift_result(pio_dev_captures[num_captures++], ops[i].bits);
+		}
+	}
+}
+
+static void pio_dev_dma_init(void) {
+	dma_channel_config c;
+
+	pio_dev_dma_tx = dma_claim_unused_channel(false);
+	pio_dev_dma_rx = dma_claim_unused_channel(false);
+	if (pio_dev_dma_tx < 0 || pio_dev_dma_rx < 0) {
+		// Without DMA, queued operations run one by one
+		return;
+	}
+
+	c = dma_channel_get_default_config(pio_dev_dma_tx);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+	channel_config_set_read_increment(&c, true);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, pio_get_dreq(pio_dev_pio, pio_dev_sm, true));
+	dma_channel_configure(pio_dev_dma_tx, &c, &pio_dev_pio->txf[pio_dev_sm],
+		pio_dev_words, 0, false);
+
+	c = dma_channel_get_default_config(pio_dev_dma_rx);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, true);
+	channel_config_set_dreq(&c, pio_get_dreq(pio_dev_pio, pio_dev_sm, false));
+	dma_channel_configure(pio_dev_dma_rx, &c, pio_dev_captures,
+		&pio_dev_pio->rxf[pio_dev_sm], 0, false);
+}
+
+static void pio_dev_dma_deinit(void) {
+	if (pio_dev_dma_tx >= 0) {
+		dma_channel_unclaim(pio_dev_dma_tx);
+		pio_dev_dma_tx = -1;
+	}
+	if (pio_dev_dma_rx >= 0) {
+		dma_channel_unclaim(pio_dev_dma_rx);
+		pio_dev_dma_rx = -1;
+	}
+}
+
+int pio_dev_tclk_get(struct jtdev *p) {
+	if (pio_dev_owns_pins) {
+		return pio_dev_tclk_level;
+	}
+	if (pio_dev_sbw) {
+		return !!(p->pin_level & JTDEV_PIN_RST);
+	}
+	return pico_dev_tclk_get(p);
+}
+
+// The IRQ line may be shared with other handlers, so only our flag counts
+static void pio_dev_strobe_irq(void) {
+	// Raised by "irq 0 rel", so the flag index is the state machine number
+	if (!pio_interrupt_get(pio_dev_pio, pio_dev_strobe_sm)) {
+		return;
+	}
+	pio_interrupt_clear(pio_dev_pio, pio_dev_strobe_sm);
+	pio_dev_strobe_busy = false;
+}
+
+static void pio_dev_strobe_init(struct jtdev *p) {
+	int sm = pio_claim_unused_sm(pio_dev_pio, false);
+	if (sm < 0) {
+		return;
+	}
+	if (!pio_can_add_program(pio_dev_pio, &tclk_strobe_program)) {
+		pio_sm_unclaim(pio_dev_pio, sm);
+		return;
+	}
+
+	pio_dev_strobe_sm = sm;
+	pio_dev_strobe_offset = pio_add_program(pio_dev_pio, &tclk_strobe_program);
+	tclk_strobe_program_init(pio_dev_pio, pio_dev_strobe_sm, pio_dev_strobe_offset, p->pin_tdi);
+
+	uint irq = pio_get_irq_num(pio_dev_pio, 0);
+	pio_set_irq0_source_enabled(pio_dev_pio,
+		(enum pio_interrupt_source)(pis_interrupt0 + pio_dev_strobe_sm), true);
+	irq_add_shared_handler(irq, pio_dev_strobe_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+	irq_set_enabled(irq, true);
+}
+
+static void pio_dev_strobe_deinit(void) {
+	if (pio_dev_strobe_sm < 0) {
+		return;
+	}
+
+	uint irq = pio_get_irq_num(pio_dev_pio, 0);
+	pio_set_irq0_source_enabled(pio_dev_pio,
+		(enum pio_interrupt_source)(pis_interrupt0 + pio_dev_strobe_sm), false);
+	irq_remove_handler(irq, pio_dev_strobe_irq);
+	// Other handlers on the line keep it enabled
+	if (!irq_has_shared_handler(irq)) {
+		irq_set_enabled(irq, false);
+	}
+
+	pio_sm_set_enabled(pio_dev_pio, pio_dev_strobe_sm, false);
+	pio_remove_program(pio_dev_pio, &tclk_strobe_program, pio_dev_strobe_offset);
+	pio_sm_unclaim(pio_dev_pio, pio_dev_strobe_sm);
+	pio_dev_strobe_sm = -1;
+}
+
+// Half a strobe period in state machine cycles, rounded to the nearest
+// achievable frequency.
+static uint32_t pio_dev_strobe_half_period(unsigned long hz) {
+	uint64_t twice_hz = 2 * (uint64_t)(hz ? hz : 1);
+	uint64_t half_period = (clock_get_hz(clk_sys) + twice_hz / 2) / twice_hz;
+
+	if (half_period < TCLK_STROBE_MIN_HALF_PERIOD) {
+		half_period = TCLK_STROBE_MIN_HALF_PERIOD;
+	} else if (half_period > TCLK_STROBE_MAX_HALF_PERIOD) {
+		half_period = TCLK_STROBE_MAX_HALF_PERIOD;
+	}
+	return half_period;
+}
+
+void pio_dev_tclk_strobe(struct jtdev *p, unsigned int count) {
+	if (pio_dev_strobe_sm < 0) {
+		pio_dev_release_pins(p);
+		pico_dev_tclk_strobe(p, count);
+		return;
+	}
+
+	// The jtag program must be done with TDI before the strobes take over
+	pio_dev_claim_pins(p);
+	pio_dev_sync();
+
+	uint32_t half_period = pio_dev_strobe_half_period(p->tclk_strobe_hz);
+	while (count) {
+		uint32_t burst = count < TCLK_STROBE_MAX_COUNT ? count : TCLK_STROBE_MAX_COUNT;
+
+		pio_dev_strobe_busy = true;
+		pio_sm_put(pio_dev_pio, pio_dev_strobe_sm, tclk_strobe_encode(burst, half_period));
+		while (pio_dev_strobe_busy) {
+			if (burst >= PIO_DEV_STROBE_IDLE_MIN) {
+				pico_dev_idle();
+			}
+		}
+		count -= burst;
+	}
+	pio_dev_tclk_level = 1;
+}
+
+void pio_dev_tck(struct jtdev *p, int out) {
+	pio_dev_release_pins(p);
+	pico_dev_tck(p, out);
+}
+
+void pio_dev_tms(struct jtdev *p, int out) {
+	pio_dev_release_pins(p);
+	pico_dev_tms(p, out);
+}
+
+void pio_dev_tdi(struct jtdev *p, int out) {
+	pio_dev_release_pins(p);
+	pico_dev_tdi(p, out);
+}
+
+void pio_dev_rst(struct jtdev *p, int out) {
+	pio_dev_sync();
+	pico_dev_rst(p, out);
+}
+
+void pio_dev_tst(struct jtdev *p, int out) {
+	pio_dev_sync();
+	pico_dev_tst(p, out);
+}
+
+int pio_dev_open(struct jtdev *p, const char *device) {
+	// Start out as the bit-banged device, and only switch over
+	// if we get a state machine to run the JTAG program on.
+	sio_dev_open(p, device);
+	pio_dev_sbw = false;
+	pio_dev_program = &jtag_program;
+	pio_dev_cycles_per_tck = JTAG_CYCLES_PER_TCK;
+
+	if (!pio_claim_free_sm_and_add_program(&jtag_program,
+			&pio_dev_pio, &pio_dev_sm, &pio_dev_offset)) {
+		return 0;
+	}
+
+	jtag_program_init(pio_dev_pio, pio_dev_sm, pio_dev_offset,
+		p->pin_tck, p->pin_tms, p->pin_tdi, p->pin_tdo,
+		pio_dev_clkdiv256(PIO_DEV_TCK_HZ) / 256.0f);
+	pio_dev_owns_pins = false;
+	pio_dev_dma_init();
+	pio_dev_strobe_init(p);
+	pio_dev_set_speed(p, PIO_DEV_TCK_HZ);
+
+	p->f = &pio_dev_func;
+	return 0;
+}
+
+void pio_dev_close(struct jtdev *p) {
+	pio_dev_release_pins(p);
+	pio_dev_strobe_deinit();
+	pio_dev_dma_deinit();
+	pio_remove_program_and_unclaim_sm(pio_dev_program, pio_dev_pio, pio_dev_sm, pio_dev_offset);
+	pico_dev_close(p);
+}
+
+const struct jtdev_func pio_dev_func = {
+	.jtdev_open      = pio_dev_open,
+	.jtdev_close     = pio_dev_close,
+	.jtdev_power_on  = pico_dev_power_on,
+	.jtdev_power_off = pico_dev_power_off,
+	.jtdev_connect   = pico_dev_connect,
+	.jtdev_release   = pico_dev_release,
+
+	.jtdev_tck = pio_dev_tck,
+	.jtdev_tms = pio_dev_tms,
+	.jtdev_tdi = pio_dev_tdi,
+	.jtdev_rst = pio_dev_rst,
+	.jtdev_tst = pio_dev_tst,
+	.jtdev_tdo_get = pico_dev_tdo_get,
+
+	.jtdev_set_speed = pio_dev_set_speed,
+
+	.jtdev_tclk        = pio_dev_tclk,
+	.jtdev_tclk_get    = pio_dev_tclk_get,
+	.jtdev_tclk_strobe = pio_dev_tclk_strobe,
+
+	.jtdev_led_green = pico_dev_led_green,
+	.jtdev_led_red   = pico_dev_led_red,
+
+	.jtdev_ir_shift     = pio_dev_ir_shift,
+	.jtdev_dr_shift_8   = pio_dev_dr_shift_8,
+	.jtdev_dr_shift_16  = pio_dev_dr_shift_16,
+	.jtdev_dr_write_16  = pio_dev_dr_write_16,
+	.jtdev_dr_capture_16 = pio_dev_dr_capture_16,
+	.jtdev_tms_sequence = pio_dev_tms_sequence,
+	.jtdev_init_dap     = jtag_default_init_dap,
+	.jtdev_run_queue    = pio_dev_run_queue,
+};
+
+// Spy-Bi-Wire has no separate TCK, TMS, TDI and TDO lines to drive or
+// sample. Only the default shift routines use these, and the SBW device
+// replaces all of them.
+void sbw_dev_tck(__unused struct jtdev *p, __unused int out) {}
+void sbw_dev_tms(__unused struct jtdev *p, __unused int out) {}
+void sbw_dev_tdi(__unused struct jtdev *p, __unused int out) {}
+
+int sbw_dev_tdo_get(__unused struct jtdev *p) {
+	return 0;
+}
+
+// RST and TEST double as SBWTDIO and SBWTCK, so they are taken back from
+// the state machine first.
+void sbw_dev_rst(struct jtdev *p, int out) {
+	pio_dev_release_pins(p);
+	pico_dev_rst(p, out);
+}
+
+void sbw_dev_tst(struct jtdev *p, int out) {
+	pio_dev_release_pins(p);
+	pico_dev_tst(p, out);
+}
+
+// Every strobe is a TCK cycle with TCLK low followed by one with TCLK high,
+// so the state machine is clocked at 2 * SBW_CYCLES_PER_TCK times the strobe
+// frequency for the duration of the burst. USB is not serviced meanwhile,
+// as a TX FIFO underrun would stretch a strobe.
+void sbw_dev_tclk_strobe(struct jtdev *p, unsigned int count) {
+	uint64_t cycles_hz = 2 * SBW_CYCLES_PER_TCK * (uint64_t)p->tclk_strobe_hz;
+	uint32_t div256 = ((uint64_t)clock_get_hz(clk_sys) * 256 + cycles_hz / 2) / cycles_hz;
+
+	if (!count) {
+		return;
+	}
+	pio_dev_claim_pins(p);
+	pio_dev_sync();
+	pio_sm_set_clkdiv(pio_dev_pio, pio_dev_sm, (div256 < 0x100 ? 0x100 : div256) / 256.0f);
+
+	while (count) {
+		uint32_t burst = count < SBW_DEV_STROBE_MAX_COUNT ? count : SBW_DEV_STROBE_MAX_COUNT;
+		uint32_t cycles = 2 * burst;
+
+		// TMS stays low, TDI alternates between low and high. The capture
+		// flag after the last cycle falls on a TDI low bit, so it is clear.
+		pio_sm_put_blocking(pio_dev_pio, pio_dev_sm, 0x80000000u | (cycles - 1));
+		for (uint32_t i = 0; i <= cycles / 16; i++) {
+			pio_sm_put_blocking(pio_dev_pio, pio_dev_sm, 0x11111111u);
+		}
+		count -= burst;
+	}
+
+	pio_dev_sync();
+	pio_sm_set_clkdiv(pio_dev_pio, pio_dev_sm, pio_dev_div256 / 256.0f);
+	pio_dev_tms_level = 0;
+	pio_dev_tclk_level = 1;
+}
+
+// Entry sequence with RST high and TAP reset for Spy-Bi-Wire, see SLAU320.
+void sbw_dev_init_dap(struct jtdev *p) {
+	pio_dev_release_pins(p);
+	p->f->jtdev_power_on(p);
+
+	pico_dev_tst(p, 0);
+	sleep_ms(4);
+	pico_dev_rst(p, 1);
+	pico_dev_tst(p, 1);
+	sleep_ms(20);
+	busy_wait_us_32(60);
+
+	// A low pulse on TEST shorter than 7 us selects Spy-Bi-Wire
+	uint32_t irq = save_and_disable_interrupts();
+	pico_dev_tst(p, 0);
+	busy_wait_us_32(1);
+	pico_dev_tst(p, 1);
+	restore_interrupts(irq);
+	busy_wait_us_32(60);
+	sleep_ms(5);
+
+	p->f->jtdev_connect(p);
+
+	// Test-Logic-Reset, Run-Test/Idle, fuse check through Pause-DR, and
+	// back to Run-Test/Idle. TCLK stays high throughout.
+	pio_dev_tms_sequence(p, 14, 0x1abf);
+}
+
+int sbw_dev_open(struct jtdev *p, const char *device) {
+	pico_dev_open(p, device);
+
+	// There is no bit-banged fallback for Spy-Bi-Wire
+	if (!pio_claim_free_sm_and_add_program(&sbw_program,
+			&pio_dev_pio, &pio_dev_sm, &pio_dev_offset)) {
+		pico_dev_close(p);
+		return -1;
+	}
+	pio_dev_sbw = true;
+	pio_dev_program = &sbw_program;
+	pio_dev_cycles_per_tck = SBW_CYCLES_PER_TCK;
+
+	sbw_program_init(pio_dev_pio, pio_dev_sm, pio_dev_offset,
+		p->pin_tst, p->pin_rst,
+		pio_dev_clkdiv256(PIO_DEV_TCK_HZ) / 256.0f);
+	pio_dev_owns_pins = false;
+	pio_dev_dma_init();
+	pio_dev_set_speed(p, PIO_DEV_TCK_HZ);
+
+	p->f = &sbw_dev_func;
+	return 0;
+}
+
+const struct jtdev_func sbw_dev_func = {
+	.jtdev_open      = sbw_dev_open,
+	.jtdev_close     = pio_dev_close,
+	.jtdev_power_on  = pico_dev_power_on,
+	.jtdev_power_off = pico_dev_power_off,
+	.jtdev_connect   = pico_dev_connect,
+	.jtdev_release   = pico_dev_release,
+
+	.jtdev_tck = sbw_dev_tck,
+	.jtdev_tms = sbw_dev_tms,
+	.jtdev_tdi = sbw_dev_tdi,
+	.jtdev_rst = sbw_dev_rst,
+	.jtdev_tst = sbw_dev_tst,
+	.jtdev_tdo_get = sbw_dev_tdo_get,
+
+	.jtdev_set_speed = pio_dev_set_speed,
+
+	.jtdev_tclk        = pio_dev_tclk,
+	.jtdev_tclk_get    = pio_dev_tclk_get,
+	.jtdev_tclk_strobe = sbw_dev_tclk_strobe,
+
+	.jtdev_led_green = pico_dev_led_green,
+	.jtdev_led_red   = pico_dev_led_red,
+
+	.jtdev_ir_shift     = pio_dev_ir_shift,
+	.jtdev_dr_shift_8   = pio_dev_dr_shift_8,
+	.jtdev_dr_shift_16  = pio_dev_dr_shift_16,
+	.jtdev_dr_write_16  = pio_dev_dr_write_16,
+	.jtdev_dr_capture_16 = pio_dev_dr_capture_16,
+	.jtdev_tms_sequence = pio_dev_tms_sequence,
+	.jtdev_init_dap     = sbw_dev_init_dap,
+	.jtdev_run_queue    = pio_dev_run_queue,
+};
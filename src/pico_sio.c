@@ -0,0 +1,103 @@
+#include <pico.h>
+#include <hardware/gpio.h>
+#include <hardware/clocks.h>
+
+#include "picofet_proto.h"
+#include "jtaglib.h"
+#include "jtdev.h"
+#include "pico_dev.h"
+#include "pico_sio.h"
+
+// Bit-banged JTAG device driving TCK, TMS and TDI together.
+//
+// Every half TCK cycle is a single masked SIO write of the combined pin
+// levels, and TDO is sampled with a single read of all GPIO inputs. IR and
+// DR scans are inlined for their fixed widths, so the shift loops have no
+// function pointer calls. The primitives live in pico_sio.h, so that jtaglib.c
+// can use them without going through sio_dev_func in static builds. Reset,
+// test and flash strobes run on the primitives of pico.c.
+//
+// This is what the PIO device falls back to when no state machine is free.
+
+#define SIO_DEV_TCK_HZ 250000
+
+uint32_t sio_dev_edge_delay;
+
+// Cycles a half TCK cycle takes without any delay, as measured by
+// sio_dev_calibrate().
+static uint32_t sio_dev_edge_overhead;
+
+// TCK edges of a 16-bit DR scan by sio_dev_shift(): three cycles to
+// Shift-DR, 16 shift cycles, the TCLK restore edge and one cycle to Update-DR
+#define SIO_DEV_DR_SCAN_EDGES (2 * 3 + 2 * 16 + 1 + 2)
+
+// Measure how many cycles a half TCK cycle takes without any extra delay,
+// averaged over real 16-bit DR scans that sample TDO, so that the frequency
+// reported is the one scans achieve. TCK, TMS and TDI are inputs while
+// measuring, so the target sees no edges.
+static void sio_dev_calibrate(struct jtdev *p) {
+	const unsigned num_scans = 256;
+	uint32_t pins = (1u << p->pin_tck) | (1u << p->pin_tms) | (1u << p->pin_tdi);
+
+	sio_dev_edge_delay = 0;
+	gpio_set_dir_in_masked(pins);
+	uint64_t start = time_us_64();
+	for (unsigned i = 0; i < num_scans; i++) {
+		sio_dev_dr_shift_16(p, 0x5555);
+	}
+	uint64_t elapsed = time_us_64() - start;
+	// Back to driving the levels last written, as recorded in pin_level
+	gpio_set_dir_out_masked(pins);
+
+	sio_dev_edge_overhead = elapsed * (clock_get_hz(clk_sys) / 1000000)
+	                      / (num_scans * SIO_DEV_DR_SCAN_EDGES);
+}
+
+unsigned long sio_dev_set_speed(struct jtdev *p, unsigned long hz) {
+	sio_dev_edge_delay = pico_dev_edge_delay_for(hz, sio_dev_edge_overhead, &p->tck_hz);
+	return p->tck_hz;
+}
+
+int sio_dev_open(struct jtdev *p, const char *device) {
+	pico_dev_open(p, device);
+
+	sio_dev_calibrate(p);
+	sio_dev_set_speed(p, SIO_DEV_TCK_HZ);
+
+	p->f = &sio_dev_func;
+	return 0;
+}
+
+const struct jtdev_func sio_dev_func = {
+	.jtdev_open      = sio_dev_open,
+	.jtdev_close     = pico_dev_close,
+	.jtdev_power_on  = pico_dev_power_on,
+	.jtdev_power_off = pico_dev_power_off,
+	.jtdev_connect   = pico_dev_connect,
+	.jtdev_release   = pico_dev_release,
+
+	.jtdev_tck = sio_dev_tck,
+	.jtdev_tms = sio_dev_tms,
+	.jtdev_tdi = sio_dev_tdi,
+	.jtdev_rst = pico_dev_rst,
+	.jtdev_tst = pico_dev_tst,
+	.jtdev_tdo_get = sio_dev_tdo_get,
+
+	.jtdev_set_speed = sio_dev_set_speed,
+
+	.jtdev_tclk        = sio_dev_tclk,
+	.jtdev_tclk_get    = sio_dev_tclk_get,
+	.jtdev_tclk_strobe = pico_dev_tclk_strobe,
+
+	.jtdev_led_green = pico_dev_led_green,
+	.jtdev_led_red   = pico_dev_led_red,
+
+	.jtdev_ir_shift     = sio_dev_ir_shift,
+	.jtdev_dr_shift_8   = sio_dev_dr_shift_8,
+	.jtdev_dr_shift_16  = sio_dev_dr_shift_16,
+	.jtdev_dr_write_16  = sio_dev_dr_write_16,
+	.jtdev_dr_capture_16 = sio_dev_dr_capture_16,
+	.jtdev_tms_sequence = sio_dev_tms_sequence,
+	.jtdev_init_dap     = jtag_default_init_dap,
+	.jtdev_run_queue    = jtag_default_run_queue,
+};
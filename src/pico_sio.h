@@ -0,0 +1,192 @@
+#ifndef PICOFET_PICO_SIO_H_
+#define PICOFET_PICO_SIO_H_
+
+#include <pico.h>
+#include <hardware/gpio.h>
+
+#include "jtdev.h"
+
+// Primitives of the parallel-pin bit-banged JTAG device (see pico_sio.c).
+//
+// They are inline so that jtaglib.c can call them directly when this device
+// is selected at build time with PICOFET_STATIC_JTDEV. The pin numbers then
+// come from pinout.h instead of struct jtdev, so that all pin masks are
+// constants and the shift loops compile down to plain SIO stores.
+
+#ifdef PICOFET_STATIC_JTDEV
+#  include "pinout.h"
+#  define SIO_DEV_PIN_TCK(p) ((void)(p), PIN_TCK)
+#  define SIO_DEV_PIN_TMS(p) ((void)(p), PIN_TMS)
+#  define SIO_DEV_PIN_TDI(p) ((void)(p), PIN_TDI)
+#  define SIO_DEV_PIN_TDO(p) ((void)(p), PIN_TDO)
+#else
+#  define SIO_DEV_PIN_TCK(p) ((p)->pin_tck)
+#  define SIO_DEV_PIN_TMS(p) ((p)->pin_tms)
+#  define SIO_DEV_PIN_TDI(p) ((p)->pin_tdi)
+#  define SIO_DEV_PIN_TDO(p) ((p)->pin_tdo)
+#endif
+
+// Busy-wait cycles after each half TCK cycle, set by sio_dev_set_speed()
+extern uint32_t sio_dev_edge_delay;
+
+struct sio_dev_pins {
+	uint32_t mask;
+	uint32_t tck;
+	uint32_t tms;
+	uint32_t tdi;
+	uint32_t tclk; // tdi if TCLK is high, 0 otherwise
+	uint     tdo;
+};
+
+static inline struct sio_dev_pins sio_dev_pins(const struct jtdev *p) {
+	struct sio_dev_pins pins;
+
+	pins.tck  = 1u << SIO_DEV_PIN_TCK(p);
+	pins.tms  = 1u << SIO_DEV_PIN_TMS(p);
+	pins.tdi  = 1u << SIO_DEV_PIN_TDI(p);
+	pins.mask = pins.tck | pins.tms | pins.tdi;
+	pins.tclk = (p->pin_level & JTDEV_PIN_TDI) ? pins.tdi : 0;
+	pins.tdo  = SIO_DEV_PIN_TDO(p);
+	return pins;
+}
+
+static inline void sio_dev_edge(const struct sio_dev_pins *pins, uint32_t value) {
+	gpio_put_masked(pins->mask, value);
+	busy_wait_at_least_cycles(sio_dev_edge_delay);
+}
+
+// Clock one TCK cycle with the given TMS and TDI levels and sample TDO.
+static inline uint32_t sio_dev_cycle(const struct sio_dev_pins *pins, uint32_t value) {
+	sio_dev_edge(pins, value);
+	sio_dev_edge(pins, value | pins->tck);
+	return (gpio_get_all() >> pins->tdo) & 1;
+}
+
+// Same as sio_dev_cycle(), but without sampling TDO.
+static inline void sio_dev_clock(const struct sio_dev_pins *pins, uint32_t value) {
+	sio_dev_edge(pins, value);
+	sio_dev_edge(pins, value | pins->tck);
+}
+
+// Drive a single pin, recording its level in the shadow pin state.
+// SIO is only written if the level changes.
+static inline void sio_dev_put(struct jtdev *p, uint8_t bit, uint pin, int out) {
+	if (!(p->pin_level & bit) == !out) {
+		return;
+	}
+	gpio_put(pin, out);
+	if (out) {
+		p->pin_level |= bit;
+	} else {
+		p->pin_level &= ~bit;
+	}
+}
+
+static inline void sio_dev_tck(struct jtdev *p, int out) {
+	sio_dev_put(p, JTDEV_PIN_TCK, SIO_DEV_PIN_TCK(p), out);
+	busy_wait_at_least_cycles(sio_dev_edge_delay);
+}
+
+static inline void sio_dev_tms(struct jtdev *p, int out) {
+	sio_dev_put(p, JTDEV_PIN_TMS, SIO_DEV_PIN_TMS(p), out);
+}
+
+static inline void sio_dev_tdi(struct jtdev *p, int out) {
+	sio_dev_put(p, JTDEV_PIN_TDI, SIO_DEV_PIN_TDI(p), out);
+}
+
+static inline int sio_dev_tdo_get(struct jtdev *p) {
+	return gpio_get(SIO_DEV_PIN_TDO(p));
+}
+
+static inline void sio_dev_tclk(struct jtdev *p, int out) {
+	sio_dev_put(p, JTDEV_PIN_TDI, SIO_DEV_PIN_TDI(p), out);
+	busy_wait_at_least_cycles(sio_dev_edge_delay);
+}
+
+static inline int sio_dev_tclk_get(struct jtdev *p) {
+	return !!(p->pin_level & JTDEV_PIN_TDI);
+}
+
+// Shift bits of data MSB first through the IR or DR, starting in
+// Run-Test/Idle or Update-xR and ending in Update-xR. This is the same
+// sequence of states jtag_default_shift() goes through. bits and capture
+// are constants at every call site, so the compiler unrolls the shift loop
+// for them.
+static inline __attribute__((always_inline))
+uint32_t sio_dev_shift(struct jtdev *p, bool ir, int bits, uint32_t data, bool capture) {
+	const struct sio_dev_pins pins = sio_dev_pins(p);
+	uint32_t tclk = pins.tclk;
+	uint32_t tdo = 0;
+
+	// Run-Test/Idle or Update-xR -> Select-DR-Scan (-> Select-IR-Scan) -> Capture-xR -> Shift-xR
+	sio_dev_clock(&pins, tclk | pins.tms);
+	if (ir) {
+		sio_dev_clock(&pins, tclk | pins.tms);
+	}
+	sio_dev_clock(&pins, tclk);
+	sio_dev_clock(&pins, tclk);
+
+	// Shift-xR, leaving to Exit1-xR on the last bit
+	for (int i = bits - 1; i >= 0; i--) {
+		uint32_t value = ((data >> i) & 1) ? pins.tdi : 0;
+		if (i == 0) {
+			value |= pins.tms;
+		}
+		if (capture) {
+			tdo = (tdo << 1) | sio_dev_cycle(&pins, value);
+		} else {
+			sio_dev_clock(&pins, value);
+		}
+	}
+
+	// Restore TCLK, then Exit1-xR -> Update-xR
+	sio_dev_edge(&pins, tclk | pins.tms | pins.tck);
+	sio_dev_clock(&pins, tclk | pins.tms);
+
+	// Scans leave TCK high, TMS high and TDI at the TCLK level
+	p->pin_level |= JTDEV_PIN_TCK | JTDEV_PIN_TMS;
+	return tdo;
+}
+
+static inline uint8_t sio_dev_ir_shift(struct jtdev *p, uint8_t ir) {
+	return sio_dev_shift(p, true, 8, ir, true);
+}
+
+static inline uint8_t sio_dev_dr_shift_8(struct jtdev *p, uint8_t dr) {
+	return sio_dev_shift(p, false, 8, dr, true);
+}
+
+static inline uint16_t sio_dev_dr_shift_16(struct jtdev *p, uint16_t dr) {
+	return sio_dev_shift(p, false, 16, dr, true);
+}
+
+static inline void sio_dev_dr_write_16(struct jtdev *p, uint16_t dr) {
+	sio_dev_shift(p, false, 16, dr, false);
+}
+
+static inline uint16_t sio_dev_dr_capture_16(struct jtdev *p) {
+	return sio_dev_shift(p, false, 16, 0x0000, true);
+}
+
+static inline void sio_dev_tms_sequence(struct jtdev *p, int bits, unsigned int value) {
+	const struct sio_dev_pins pins = sio_dev_pins(p);
+	uint32_t tms = 0;
+
+	if (bits <= 0) {
+		return;
+	}
+	for (int i = 0; i < bits; i++) {
+		tms = (value & (1u << i)) ? pins.tms : 0;
+		sio_dev_clock(&pins, pins.tclk | tms);
+	}
+
+	p->pin_level |= JTDEV_PIN_TCK;
+	if (tms) {
+		p->pin_level |= JTDEV_PIN_TMS;
+	} else {
+		p->pin_level &= ~JTDEV_PIN_TMS;
+	}
+}
+
+#endif
@@ -34,6 +34,7 @@
 	X(552, PUC_FAILED,        "PUC Failed")\
 	X(553, TOO_MANY_BREAKS,   "Too many Breakpoints")\
 	X(554, OUT_OF_BOUNDS,     "Address or Size is Out of Bounds")\
+	X(555, FLASH_VIOLATION,   "Flash Access Violation")\
 	X(201, CONTENT_MISMATCH,  "Verification succeeded, but contents differ")\
 	X(350, CONTINUE_TRANSFER, "Go Ahead with Transfer")\
 	X(400, TIMED_OUT,         "JTAG connection with MCU timed out")\
@@ -62,7 +62,7 @@
 #endif
 
 #ifndef PIN_SBWTCK
-#  define PIN_SWBTCK PIN_TST
+#  define PIN_SBWTCK PIN_TST
 #endif
 
 #ifndef PIN_SBWTDIO